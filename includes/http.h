@@ -40,6 +40,14 @@ extern "C" {
 #define HTTP_COOKIE_BUFSIZE	1024
 #define HTTP_DATE_MAXSIZE	255
 #define HTTP_REQUEST_LIMIT	1000
+#define HTTP_REQUEST_BUDGET	100
+#define HTTP_REQUEST_ARENA	2048
+#define HTTP_ARENA_ALIGN	8
+#define HTTP_SEND_HIGHWATER	65536
+#define HTTP_COMPRESS_MIN	256
+#define HTTP_COMPRESS_LEVEL	1
+#define HTTP_COMPRESS_TYPES_MAX	16
+#define HTTP_ROUTE_PARAMS_MAX	10
 #define HTTP_BODY_DISK_PATH	"tmp_files"
 #define HTTP_BODY_DISK_OFFLOAD	0
 #define HTTP_BODY_PATH_MAX	256
@@ -60,6 +68,12 @@ extern "C" {
 #define HTTP_STATE_COMPLETE	2
 #define HTTP_STATE_RETRY	3
 
+struct http_arena {
+	size_t			len;
+	size_t			offset;
+	struct http_arena	*next;
+};
+
 struct http_header {
 	char			*header;
 	char			*value;
@@ -166,6 +180,17 @@ struct http_file {
 	TAILQ_ENTRY(http_file)	list;
 };
 
+/* A builtin asset as generated by kodev, see http_serve_asset(). */
+struct http_asset {
+	const u_int8_t		*data;
+	size_t			len;
+	const char		*etag;
+	const u_int8_t		*gzip;
+	size_t			gzip_len;
+	const char		*gzip_etag;
+	const char		*type;
+};
+
 #define HTTP_METHOD_GET		0
 #define HTTP_METHOD_POST	1
 #define HTTP_METHOD_PUT		2
@@ -173,6 +198,30 @@ struct http_file {
 #define HTTP_METHOD_HEAD	4
 #define HTTP_METHOD_OPTIONS	5
 
+#define HTTP_HDR_ACCEPT			0
+#define HTTP_HDR_ACCEPT_ENCODING	1
+#define HTTP_HDR_ACCEPT_LANGUAGE	2
+#define HTTP_HDR_AUTHORIZATION		3
+#define HTTP_HDR_CACHE_CONTROL		4
+#define HTTP_HDR_CONNECTION		5
+#define HTTP_HDR_CONTENT_LENGTH		6
+#define HTTP_HDR_CONTENT_TYPE		7
+#define HTTP_HDR_COOKIE			8
+#define HTTP_HDR_EXPECT			9
+#define HTTP_HDR_HOST			10
+#define HTTP_HDR_IF_MODIFIED_SINCE	11
+#define HTTP_HDR_IF_NONE_MATCH		12
+#define HTTP_HDR_ORIGIN			13
+#define HTTP_HDR_RANGE			14
+#define HTTP_HDR_REFERER		15
+#define HTTP_HDR_SEC_WEBSOCKET_KEY	16
+#define HTTP_HDR_SEC_WEBSOCKET_VERSION	17
+#define HTTP_HDR_TRANSFER_ENCODING	18
+#define HTTP_HDR_UPGRADE		19
+#define HTTP_HDR_USER_AGENT		20
+#define HTTP_HDR_X_FORWARDED_FOR	21
+#define HTTP_HDR_MAX			22
+
 #define HTTP_REQUEST_COMPLETE		0x0001
 #define HTTP_REQUEST_DELETE		0x0002
 #define HTTP_REQUEST_SLEEPING		0x0004
@@ -180,22 +229,36 @@ struct http_file {
 #define HTTP_REQUEST_RETAIN_EXTRA	0x0040
 #define HTTP_REQUEST_NO_CONTENT_LENGTH	0x0080
 #define HTTP_REQUEST_AUTHED		0x0100
+#define HTTP_REQUEST_CHUNKED		0x0200
+#define HTTP_REQUEST_CHUNKED_CLOSE	0x0400
+#define HTTP_REQUEST_ROUTE_PARAMS	0x0800
 
 #define HTTP_VALIDATOR_IS_REQUEST	0x8000
 
+#define HTTP_COMPRESS_GZIP		1
+#define HTTP_COMPRESS_DEFLATE		2
+
 struct kore_task;
+struct http_deflate;
 
 struct http_request {
 	u_int8_t			method;
 	u_int8_t			fsm_state;
+	u_int8_t			chunk_state;
 	u_int16_t			flags;
 	u_int16_t			status;
 	u_int64_t			start;
 	u_int64_t			end;
 	u_int64_t			total;
+	u_int64_t			start_us;
+	u_int64_t			end_us;
+	u_int64_t			total_us;
 	char				*host;
 	char				*path;
 	char				*agent;
+	u_int8_t			*headers;
+	char				*hdr_values[HTTP_HDR_MAX];
+	struct http_arena		*arena;
 	struct connection		*owner;
 	struct kore_buf			*http_body;
 	int				http_body_fd;
@@ -203,10 +266,13 @@ struct http_request {
 	size_t				http_body_length;
 	size_t				http_body_offset;
 	size_t				content_length;
+	struct http_deflate		*deflate;
 	void				*hdlr_extra;
 	size_t				state_len;
 	char				*query_string;
 	struct kore_module_handle	*hdlr;
+	u_int8_t			route_nparams;
+	regmatch_t			route_params[HTTP_ROUTE_PARAMS_MAX];
 
 #if defined(KORE_USE_PYTHON)
 	void				*py_coro;
@@ -236,6 +302,12 @@ extern size_t		http_body_max;
 extern u_int64_t	http_hsts_enable;
 extern u_int16_t	http_keepalive_time;
 extern u_int32_t	http_request_limit;
+extern u_int32_t	http_request_budget;
+extern u_int32_t	http_request_arena;
+extern u_int32_t	http_send_highwater;
+extern u_int32_t	http_compress_min;
+extern int		http_compress_level;
+extern char		*http_compress_types[];
 extern u_int64_t	http_body_disk_offload;
 extern char		*http_body_disk_path;
 
@@ -245,6 +317,7 @@ void		http_init(void);
 void		http_cleanup(void);
 void 		http_server_version(const char *);
 void		http_process(void);
+int		http_process_ready(void);
 const char	*http_status_text(int);
 const char	*http_method_text(int);
 time_t		http_date_to_time(char *);
@@ -257,14 +330,30 @@ ssize_t		http_body_read(struct http_request *, void *, size_t);
 void		http_response(struct http_request *, int, const void *, size_t);
 void		http_serveable(struct http_request *, const void *,
 		    size_t, const char *, const char *);
+void		http_serve_asset(struct http_request *,
+		    const struct http_asset *);
+int		http_compress_accepted(struct http_request *);
+int		http_etag_match(const char *, const char *);
 void		http_response_stream(struct http_request *, int, void *,
 		    size_t, int (*cb)(struct netbuf *), void *);
+void		http_response_fd(struct http_request *, int, int,
+		    off_t, size_t);
+void		http_response_chunked_begin(struct http_request *, int);
+int		http_response_chunk(struct http_request *,
+		    const void *, size_t);
+void		http_response_chunked_end(struct http_request *);
 int		http_request_header(struct http_request *,
 		    const char *, char **);
+int		http_request_header_id(struct http_request *, int, char **);
+int		http_route_param(struct http_request *, u_int8_t,
+		    const char **, size_t *);
 void		http_response_header(struct http_request *,
 		    const char *, const char *);
-int		http_request_new(struct connection *, const char *,
-		    const char *, const char *, const char *,
+void		*http_request_arena_alloc(struct http_request *, size_t);
+char		*http_request_arena_strdup(struct http_request *,
+		    const char *);
+int		http_request_new(struct connection *, char *,
+		    const char *, char *, const char *,
 		    struct http_request **);
 int		http_state_run(struct http_state *, u_int8_t,
 		    struct http_request *);
@@ -24,6 +24,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -67,6 +68,7 @@ extern int daemon(int, int);
 #define KORE_TLS_VERSION_BOTH	2
 
 #define KORE_RESEED_TIME	(1800 * 1000)
+#define KORE_TICKET_ROTATE_TIME	(3600 * 1000)
 
 #define errno_s			strerror(errno)
 #define ssl_errno_s		ERR_error_string(ERR_get_error(), NULL)
@@ -86,6 +88,8 @@ extern int daemon(int, int);
 #define NETBUF_RECV			0
 #define NETBUF_SEND			1
 #define NETBUF_SEND_PAYLOAD_MAX		8192
+#define NETBUF_SEND_RECORD_MAX		16384
+#define NETBUF_SEND_IOV_MAX		64
 
 #define NETBUF_LAST_CHAIN		0
 #define NETBUF_BEFORE_CHAIN		1
@@ -94,6 +98,7 @@ extern int daemon(int, int);
 #define NETBUF_FORCE_REMOVE	0x02
 #define NETBUF_MUST_RESEND	0x04
 #define NETBUF_IS_STREAM	0x10
+#define NETBUF_IS_FILE		0x20
 
 #define X509_GET_CN(c, o, l)					\
 	X509_NAME_get_text_by_NID(X509_get_subject_name(c),	\
@@ -119,6 +124,9 @@ struct netbuf {
 	void			*extra;
 	int			(*cb)(struct netbuf *);
 
+	int			fd;
+	off_t			fd_off;
+
 	TAILQ_ENTRY(netbuf)	list;
 };
 
@@ -164,6 +172,8 @@ TAILQ_HEAD(netbuf_head, netbuf);
 #define KORE_CONNECTION_PRUNE_DISCONNECT	0
 #define KORE_CONNECTION_PRUNE_ALL		1
 
+struct kore_idle_list;
+
 struct connection {
 	u_int8_t		type;
 	int			fd;
@@ -182,6 +192,10 @@ struct connection {
 	void			(*disconnect)(struct connection *);
 	int			(*read)(struct connection *, size_t *);
 	int			(*write)(struct connection *, size_t, size_t *);
+	int			(*writev)(struct connection *,
+				    struct iovec *, int, size_t *);
+	int			(*sendfile)(struct connection *,
+				    struct netbuf *, size_t *);
 
 	u_int8_t		addrtype;
 	union {
@@ -190,8 +204,10 @@ struct connection {
 	} addr;
 
 	struct {
-		u_int64_t	length;
-		u_int64_t	start;
+		u_int64_t		length;
+		u_int64_t		start;
+		struct kore_idle_list	*bucket;
+		TAILQ_ENTRY(connection)	list;
 	} idle_timer;
 
 	struct netbuf_head	send_queue;
@@ -241,6 +257,7 @@ struct listener {
 	u_int8_t			type;
 	u_int8_t			addrtype;
 	int				fd;
+	int				*fds;
 	struct kore_runtime_call	*connect;
 
 	union {
@@ -279,6 +296,10 @@ struct kore_auth {
 
 #define HANDLER_TYPE_STATIC	1
 #define HANDLER_TYPE_DYNAMIC	2
+#define HANDLER_TYPE_FILEMAP	3
+
+#define KORE_FILEMAP_CACHE_MAX	1024
+#define KORE_FILEMAP_CACHE_TTL	1000
 
 #endif /* !KORE_NO_HTTP */
 
@@ -322,6 +343,8 @@ struct kore_module_handle {
 	struct kore_runtime_call	*rcall;
 #if !defined(KORE_NO_HTTP)
 	struct kore_auth			*auth;
+	int					compress;
+	char					*root;
 	TAILQ_HEAD(, kore_handler_params)	params;
 #endif
 	TAILQ_ENTRY(kore_module_handle)		list;
@@ -335,11 +358,19 @@ struct kore_worker {
 	struct connection		*msg[2];
 	u_int8_t			has_lock;
 	struct kore_module_handle	*active_hdlr;
+
+	/* Published by the worker every iteration, read by its peers. */
+	volatile u_int32_t		load_connections;
+	volatile u_int32_t		load_requests;
+	volatile u_int32_t		load_latency;
 };
 
+struct kore_route;
+
 struct kore_domain {
 	char					*domain;
 	int					accesslog;
+	int					compress;
 #if !defined(KORE_NO_TLS)
 	char					*cafile;
 	char					*crlfile;
@@ -348,6 +379,9 @@ struct kore_domain {
 	SSL_CTX					*ssl_ctx;
 #endif
 	TAILQ_HEAD(, kore_module_handle)	handlers;
+#if !defined(KORE_NO_HTTP)
+	struct kore_route			*routes;
+#endif
 	TAILQ_ENTRY(kore_domain)		list;
 };
 
@@ -409,7 +443,7 @@ struct kore_timer {
 	void		*arg;
 	void		(*cb)(void *, u_int64_t);
 
-	TAILQ_ENTRY(kore_timer)	list;
+	LIST_ENTRY(kore_timer)	list;
 };
 
 #define KORE_WORKER_KEYMGR	0
@@ -422,6 +456,8 @@ struct kore_timer {
 #define KORE_MSG_SHUTDOWN	5
 #define KORE_MSG_ENTROPY_REQ	6
 #define KORE_MSG_ENTROPY_RESP	7
+#define KORE_MSG_TICKET_REQ	8
+#define KORE_MSG_TICKET_KEYS	9
 
 /* Predefined message targets. */
 #define KORE_MSG_PARENT		1000
@@ -436,12 +472,35 @@ struct kore_msg {
 
 #if !defined(KORE_NO_TLS)
 struct kore_keyreq {
+	u_int32_t	id;
 	int		padding;
 	char		domain[KORE_DOMAINNAME_LEN];
 	u_int8_t	domain_len;
 	u_int16_t	data_len;
 	u_int8_t	data[];
 };
+
+struct kore_keyres {
+	u_int32_t	id;
+	u_int16_t	data_len;
+	u_int8_t	data[];
+};
+
+/* Session ticket keys, current key first followed by the previous. */
+#define KORE_TICKET_KEYS	2
+
+struct kore_ticket_key {
+	u_int8_t	name[16];
+	u_int8_t	aes_key[32];
+	u_int8_t	hmac_key[32];
+};
+
+struct kore_tls_stats {
+	u_int64_t	session_hits;
+	u_int64_t	session_misses;
+	u_int64_t	ticket_hits;
+	u_int64_t	ticket_misses;
+};
 #endif
 
 #if !defined(KORE_SINGLE_BINARY)
@@ -462,6 +521,9 @@ extern int	tls_version;
 #if !defined(KORE_NO_TLS)
 extern DH	*tls_dhparam;
 extern char	*rand_file;
+extern u_int8_t	keymgr_workers;
+extern u_int32_t	tls_session_cache;
+extern int	tls_ktls;
 #endif
 
 extern u_int8_t			nlisteners;
@@ -474,7 +536,11 @@ extern u_int32_t		worker_active_connections;
 extern u_int32_t		worker_accept_threshold;
 extern u_int64_t		kore_websocket_maxframe;
 extern u_int64_t		kore_websocket_timeout;
+extern u_int32_t		kore_filemap_cache_max;
+extern u_int64_t		kore_filemap_cache_ttl;
 extern u_int32_t		kore_socket_backlog;
+extern u_int8_t			kore_socket_reuseport;
+extern u_int8_t			kore_socket_reuseport_cpu;
 
 extern struct listener_head	listeners;
 extern struct kore_worker	*worker;
@@ -484,12 +550,15 @@ extern struct kore_pool		nb_pool;
 
 void		kore_signal(int);
 void		kore_worker_wait(int);
+void		kore_worker_load_report(void);
 void		kore_worker_init(void);
 void		kore_worker_shutdown(void);
 void		kore_worker_privdrop(void);
 void		kore_worker_dispatch_signal(int);
 void		kore_worker_spawn(u_int16_t, u_int16_t);
 void		kore_worker_entry(struct kore_worker *);
+int		kore_worker_is_keymgr(u_int16_t);
+u_int16_t	kore_worker_keymgr_id(u_int8_t);
 
 struct kore_worker	*kore_worker_data(u_int8_t);
 
@@ -502,10 +571,14 @@ void		kore_platform_enable_accept(void);
 void		kore_platform_disable_accept(void);
 int		kore_platform_event_wait(u_int64_t);
 void		kore_platform_event_all(int, void *);
+void		kore_platform_event_remove(int);
 void		kore_platform_schedule_read(int, void *);
 void		kore_platform_schedule_write(int, void *);
 void		kore_platform_event_schedule(int, int, int, void *);
 void		kore_platform_worker_setcpu(struct kore_worker *);
+int		kore_platform_reuseport_cpu(int, u_int16_t, u_int16_t);
+int		kore_platform_sendfile(struct connection *,
+		    struct netbuf *, size_t *);
 
 void		kore_accesslog_init(void);
 void		kore_accesslog_worker_init(void);
@@ -526,6 +599,8 @@ struct kore_timer	*kore_timer_add(void (*cb)(void *, u_int64_t),
 
 int		kore_sockopt(int, int, int);
 void		kore_listener_cleanup(void);
+void		kore_listener_reuseport(u_int16_t, u_int16_t);
+void		kore_listener_select(u_int16_t);
 int		kore_server_bind(const char *, const char *, const char *);
 #if !defined(KORE_NO_TLS)
 int		kore_tls_sni_cb(SSL *, int *, void *);
@@ -547,8 +622,13 @@ void			kore_connection_check_idletimer(u_int64_t,
 			    struct connection *);
 int			kore_connection_accept(struct listener *,
 			    struct connection **);
+int			kore_connection_accept_fd(struct listener *, int,
+			    struct connection **);
 
 u_int64_t	kore_time_ms(void);
+u_int64_t	kore_time_update(void);
+u_int64_t	kore_time_mono_ms(void);
+u_int64_t	kore_time_mono_us(void);
 void		kore_log_init(void);
 
 void		*kore_malloc(size_t);
@@ -583,7 +663,7 @@ int		kore_snprintf(char *, size_t, int *, const char *, ...);
 long long	kore_strtonum(const char *, int, long long, long long, int *);
 int		kore_base64_encode(const void *, size_t, char **);
 int		kore_base64_decode(char *, u_int8_t **, size_t *);
-void		*kore_mem_find(void *, size_t, void *, size_t);
+void		*kore_mem_find(void *, size_t, const void *, size_t);
 char		*kore_text_trim(char *, size_t);
 char		*kore_read_line(FILE *, char *, size_t);
 
@@ -619,6 +699,14 @@ void		*kore_module_getsym(const char *, struct kore_runtime **);
 void		kore_domain_load_crl(void);
 void		kore_domain_keymgr_init(void);
 void		kore_domain_tlsinit(struct kore_domain *);
+#if !defined(KORE_NO_TLS)
+int		kore_domain_tls_accept(struct connection *);
+void		kore_domain_keymgr_cancel(struct connection *);
+void		kore_domain_keymgr_timeout(void);
+size_t		kore_domain_tls_cache_len(void);
+void		kore_domain_tls_cache_init(void *);
+void		kore_domain_tls_stats(struct kore_tls_stats *);
+#endif
 void		kore_module_load(const char *, const char *, int);
 void		kore_domain_callback(void (*cb)(struct kore_domain *));
 int		kore_module_handler_new(const char *, const char *,
@@ -654,6 +742,16 @@ int		kore_validator_run(struct http_request *, const char *, char *);
 int		kore_validator_check(struct http_request *,
 		    struct kore_validator *, void *);
 struct kore_validator	*kore_validator_lookup(const char *);
+
+int		kore_filemap_new(const char *, const char *, const char *,
+		    const char *);
+int		kore_filemap_match(struct kore_module_handle *, const char *);
+int		kore_filemap_serve(struct http_request *);
+
+void		kore_route_build(struct kore_domain *);
+void		kore_route_free(struct kore_domain *);
+struct kore_module_handle	*kore_route_lookup(struct kore_domain *,
+				    const char *);
 #endif
 
 void		fatal(const char *, ...) __attribute__((noreturn));
@@ -675,6 +773,7 @@ int		net_read(struct connection *, size_t *);
 int		net_read_tls(struct connection *, size_t *);
 int		net_write(struct connection *, size_t, size_t *);
 int		net_write_tls(struct connection *, size_t, size_t *);
+int		net_writev(struct connection *, struct iovec *, int, size_t *);
 void		net_recv_reset(struct connection *, size_t,
 		    int (*cb)(struct netbuf *));
 void		net_remove_netbuf(struct netbuf_head *, struct netbuf *);
@@ -685,6 +784,8 @@ void		net_recv_expand(struct connection *c, size_t,
 void		net_send_queue(struct connection *, const void *, size_t);
 void		net_send_stream(struct connection *, void *,
 		    size_t, int (*cb)(struct netbuf *), struct netbuf **);
+void		net_send_file(struct connection *, int, off_t,
+		    size_t, int (*cb)(struct netbuf *), struct netbuf **);
 
 void		kore_buf_free(struct kore_buf *);
 struct kore_buf	*kore_buf_alloc(size_t);
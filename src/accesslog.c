@@ -14,8 +14,10 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/param.h>
 #include <sys/socket.h>
 
+#include <limits.h>
 #include <poll.h>
 #include <time.h>
 
@@ -25,7 +27,7 @@
 struct kore_log_packet {
 	u_int8_t	method;
 	int		status;
-	u_int16_t	time_req;
+	u_int32_t	time_req;
 	u_int16_t	worker_id;
 	u_int16_t	worker_cpu;
 	u_int8_t	addrtype;
@@ -105,9 +107,10 @@ kore_accesslog_write(const void *data, u_int32_t len)
 
 	time(&now);
 	tbuf = kore_time_to_date(now);
-	l = asprintf(&buf, "[%s] %s %d %s %s (w#%d) (%dms) (%s) (%s)\n",
+	l = asprintf(&buf, "[%s] %s %d %s %s (w#%d) (%u.%03ums) (%s) (%s)\n",
 	    tbuf, addr, logpacket.status, method, logpacket.path,
-	    logpacket.worker_id, logpacket.time_req, cn, logpacket.agent);
+	    logpacket.worker_id, logpacket.time_req / 1000,
+	    logpacket.time_req % 1000, cn, logpacket.agent);
 	if (l == -1) {
 		kore_log(LOG_WARNING,
 		    "kore_accesslog_write(): asprintf() == -1");
@@ -149,7 +152,7 @@ kore_accesslog(struct http_request *req)
 	logpacket.method = req->method;
 	logpacket.worker_id = worker->id;
 	logpacket.worker_cpu = worker->cpu;
-	logpacket.time_req = req->total;
+	logpacket.time_req = MIN(req->total_us, UINT_MAX);
 
 	if (kore_strlcpy(logpacket.host,
 	    req->host, sizeof(logpacket.host)) >= sizeof(logpacket.host))
@@ -110,7 +110,7 @@ kore_auth_cookie(struct http_request *req, struct kore_auth *auth)
 	size_t		len, slen;
 	char		*value, *c, *cookie, *cookies[HTTP_MAX_COOKIES];
 
-	if (!http_request_header(req, "cookie", &c))
+	if (!http_request_header_id(req, HTTP_HDR_COOKIE, &c))
 		return (KORE_RESULT_ERROR);
 
 	cookie = kore_strdup(c);
@@ -16,7 +16,9 @@
 
 #include <sys/param.h>
 #include <sys/event.h>
+#include <sys/socket.h>
 #include <sys/sysctl.h>
+#include <sys/uio.h>
 
 #if defined(__FreeBSD_version)
 #include <sys/cpuset.h>
@@ -74,6 +76,12 @@ kore_platform_worker_setcpu(struct kore_worker *kw)
 #endif /* __FreeBSD_version */
 }
 
+int
+kore_platform_reuseport_cpu(int fd, u_int16_t count, u_int16_t first)
+{
+	return (KORE_RESULT_ERROR);
+}
+
 void
 kore_platform_event_init(void)
 {
@@ -121,6 +129,8 @@ kore_platform_event_wait(u_int64_t timer)
 	timeo.tv_sec = timer / 1000;
 	timeo.tv_nsec = (timer % 1000) * 1000000;
 	n = kevent(kfd, NULL, 0, events, event_count, &timeo);
+	kore_time_update();
+
 	if (n == -1) {
 		if (errno == EINTR)
 			return (0);
@@ -221,6 +231,12 @@ kore_platform_event_all(int fd, void *c)
 	kore_platform_event_schedule(fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, c);
 }
 
+/* Closing the descriptor takes it out of the kqueue. */
+void
+kore_platform_event_remove(int fd)
+{
+}
+
 void
 kore_platform_event_schedule(int fd, int type, int flags, void *data)
 {
@@ -274,3 +290,56 @@ kore_platform_proctitle(char *title)
 	setproctitle("%s", title);
 #endif
 }
+
+int
+kore_platform_sendfile(struct connection *c, struct netbuf *nb,
+    size_t *written)
+{
+	off_t		off, len;
+#if !defined(__FreeBSD_version) && !defined(__MACH__)
+	ssize_t		r;
+	u_int8_t	buf[NETBUF_SEND_PAYLOAD_MAX];
+#endif
+
+	*written = 0;
+	off = nb->fd_off + (off_t)nb->s_off;
+	len = nb->b_len - nb->s_off;
+
+#if defined(__FreeBSD_version)
+	if (sendfile(nb->fd, c->fd, off, len, NULL, &len, 0) == -1) {
+#elif defined(__MACH__)
+	if (sendfile(nb->fd, c->fd, off, &len, NULL, 0) == -1) {
+#else
+	/* No sendfile(), bounce through a small buffer instead. */
+	len = MIN(len, (off_t)sizeof(buf));
+	if ((r = pread(nb->fd, buf, len, off)) <= 0) {
+		kore_debug("pread(): %s", r == 0 ? "file shrunk" : errno_s);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if ((len = write(c->fd, buf, r)) == -1) {
+		len = 0;
+#endif
+		switch (errno) {
+		case EINTR:
+			*written = (size_t)len;
+			return (KORE_RESULT_OK);
+		case EAGAIN:
+			*written = (size_t)len;
+			c->flags &= ~CONN_WRITE_POSSIBLE;
+			return (KORE_RESULT_OK);
+		default:
+			kore_debug("sendfile(): %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	if (len == 0) {
+		kore_debug("sendfile(): file %d shrunk", nb->fd);
+		return (KORE_RESULT_ERROR);
+	}
+
+	*written = (size_t)len;
+
+	return (KORE_RESULT_OK);
+}
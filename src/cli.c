@@ -40,6 +40,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <utime.h>
+#define ZLIB_CONST
+#include <zlib.h>
 
 #define errno_s			strerror(errno)
 #define ssl_errno_s		ERR_error_string(ERR_get_error(), NULL)
@@ -156,6 +158,7 @@ static void		cli_file_writef(int, const char *, ...);
 static void		cli_file_open(const char *, int, int *);
 static void		cli_file_remove(char *, struct dirent *);
 static void		cli_build_asset(char *, struct dirent *);
+static u_int8_t		*cli_asset_gzip(const void *, size_t, size_t *);
 static void		cli_file_write(int, const void *, size_t);
 static int		cli_vasprintf(char **, const char *, ...);
 static void		cli_spawn_proc(void (*cb)(void *), void *);
@@ -232,11 +235,15 @@ static const char *gen_dirs[] = {
 };
 
 static const char *http_serveable_function =
+	"static const struct http_asset asset_http_%s_%s = {\n"
+	"	asset_%s_%s, %" PRIu32 ", \"\\\"%s\\\"\",\n"
+	"	asset_gzip_%s_%s, %" PRIu32 ", \"\\\"%s-gzip\\\"\",\n"
+	"	\"%s\"\n"
+	"};\n\n"
 	"int\n"
 	"asset_serve_%s_%s(struct http_request *req)\n"
 	"{\n"
-	"	http_serveable(req, asset_%s_%s, asset_len_%s_%s,\n"
-	"	    asset_sha256_%s_%s, \"%s\");\n"
+	"	http_serve_asset(req, &asset_http_%s_%s);\n"
 	"	return (KORE_RESULT_OK);\n"
 	"}\n";
 
@@ -901,6 +908,10 @@ cli_write_asset(const char *n, const char *e, struct buildopt *bopt)
 	cli_file_writef(s_fd, "extern const char *asset_sha256_%s_%s;\n", n, e);
 
 	if (bopt->flavor_nohttp == 0) {
+		cli_file_writef(s_fd,
+		    "extern const u_int8_t asset_gzip_%s_%s[];\n", n, e);
+		cli_file_writef(s_fd,
+		    "extern const u_int32_t asset_gzip_len_%s_%s;\n", n, e);
 		cli_file_writef(s_fd,
 		    "int asset_serve_%s_%s(struct http_request *);\n", n, e);
 	}
@@ -916,8 +927,9 @@ cli_build_asset(char *fpath, struct dirent *dp)
 	struct mime_type	*mime;
 	struct buildopt		*bopt;
 	const char		*mime_type;
+	size_t			gzlen;
 	int			in, out, i, len;
-	u_int8_t		*d, digest[SHA256_DIGEST_LENGTH];
+	u_int8_t		*d, *gz, digest[SHA256_DIGEST_LENGTH];
 	char			*cpath, *ext, *opath, *p, *name;
 	char			hash[(SHA256_DIGEST_LENGTH * 2) + 1];
 
@@ -1027,8 +1039,28 @@ cli_build_asset(char *fpath, struct dirent *dp)
 		cli_file_writef(out,
 		    "const char *asset_sha256_%s_%s = \"\\\"%s\\\"\";\n",
 		    name, ext, hash);
+
+		/*
+		 * Keep a gzip variant around if it actually saves bytes,
+		 * otherwise its length is 0 and it is never served.
+		 */
+		gz = cli_asset_gzip(base, st.st_size, &gzlen);
+
+		cli_file_writef(out,
+		    "\nconst u_int8_t asset_gzip_%s_%s[] = {\n", name, ext);
+		for (off = 0; off < (off_t)gzlen; off++)
+			cli_file_writef(out, "0x%02x,", gz[off]);
+		cli_file_writef(out, "0x00\n};\n\n");
+		cli_file_writef(out,
+		    "const u_int32_t asset_gzip_len_%s_%s = %" PRIu32 ";\n\n",
+		    name, ext, (u_int32_t)gzlen);
+
 		cli_file_writef(out, http_serveable_function,
-		    name, ext, name, ext, name, ext, name, ext, mime_type);
+		    name, ext, name, ext, (u_int32_t)st.st_size, hash,
+		    name, ext, (u_int32_t)gzlen, hash, mime_type,
+		    name, ext, name, ext);
+
+		free(gz);
 	}
 
 	/* Write the file symbols into assets.h so they can be used. */
@@ -1050,6 +1082,38 @@ cli_build_asset(char *fpath, struct dirent *dp)
 	free(name);
 }
 
+static u_int8_t *
+cli_asset_gzip(const void *data, size_t len, size_t *olen)
+{
+	z_stream	strm;
+	u_int8_t	*out;
+	size_t		bound;
+
+	memset(&strm, 0, sizeof(strm));
+	if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED,
+	    15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+		fatal("deflateInit2: failed");
+
+	bound = deflateBound(&strm, len);
+	out = cli_malloc(bound);
+
+	strm.next_in = data;
+	strm.avail_in = len;
+	strm.next_out = out;
+	strm.avail_out = bound;
+
+	if (deflate(&strm, Z_FINISH) != Z_STREAM_END)
+		fatal("deflate: failed to compress asset");
+
+	*olen = strm.total_out;
+	(void)deflateEnd(&strm);
+
+	if (*olen >= len)
+		*olen = 0;
+
+	return (out);
+}
+
 static void
 cli_add_source_file(char *name, char *fpath, char *opath, struct stat *st,
     int build)
@@ -62,14 +62,19 @@ static int		configure_max_connections(char *);
 static int		configure_accept_threshold(char *);
 static int		configure_set_affinity(char *);
 static int		configure_socket_backlog(char *);
+static int		configure_socket_reuseport(char *);
+static int		configure_socket_reuseport_cpu(char *);
 
 #if !defined(KORE_NO_TLS)
 static int		configure_rand_file(char *);
+static int		configure_keymgr_workers(char *);
 static int		configure_certfile(char *);
 static int		configure_certkey(char *);
 static int		configure_tls_version(char *);
 static int		configure_tls_cipher(char *);
 static int		configure_tls_dhparam(char *);
+static int		configure_tls_session_cache(char *);
+static int		configure_tls_ktls(char *);
 static int		configure_client_certificates(char *);
 #endif
 
@@ -83,6 +88,16 @@ static int		configure_http_body_max(char *);
 static int		configure_http_hsts_enable(char *);
 static int		configure_http_keepalive_time(char *);
 static int		configure_http_request_limit(char *);
+static int		configure_http_request_budget(char *);
+static int		configure_http_request_arena(char *);
+static int		configure_http_send_highwater(char *);
+static int		configure_http_compress_min(char *);
+static int		configure_http_compress_level(char *);
+static int		configure_http_compress_types(char *);
+static int		configure_compress(char *);
+static int		configure_filemap(char *);
+static int		configure_filemap_cache(char *);
+static int		configure_filemap_cache_ttl(char *);
 static int		configure_http_body_disk_offload(char *);
 static int		configure_http_body_disk_path(char *);
 static int		configure_validator(char *);
@@ -132,11 +147,16 @@ static struct {
 	{ "worker_set_affinity",	configure_set_affinity },
 	{ "pidfile",			configure_pidfile },
 	{ "socket_backlog",		configure_socket_backlog },
+	{ "socket_reuseport",		configure_socket_reuseport },
+	{ "socket_reuseport_cpu",	configure_socket_reuseport_cpu },
 #if !defined(KORE_NO_TLS)
 	{ "tls_version",		configure_tls_version },
 	{ "tls_cipher",			configure_tls_cipher },
 	{ "tls_dhparam",		configure_tls_dhparam },
+	{ "tls_session_cache",		configure_tls_session_cache },
+	{ "tls_ktls",			configure_tls_ktls },
 	{ "rand_file",			configure_rand_file },
+	{ "keymgr_workers",		configure_keymgr_workers },
 	{ "certfile",			configure_certfile },
 	{ "certkey",			configure_certkey },
 	{ "client_certificates",	configure_client_certificates },
@@ -145,11 +165,21 @@ static struct {
 	{ "static",			configure_static_handler },
 	{ "dynamic",			configure_dynamic_handler },
 	{ "accesslog",			configure_accesslog },
+	{ "compress",			configure_compress },
+	{ "filemap",			configure_filemap },
+	{ "filemap_cache",		configure_filemap_cache },
+	{ "filemap_cache_ttl",		configure_filemap_cache_ttl },
 	{ "http_header_max",		configure_http_header_max },
 	{ "http_body_max",		configure_http_body_max },
 	{ "http_hsts_enable",		configure_http_hsts_enable },
 	{ "http_keepalive_time",	configure_http_keepalive_time },
 	{ "http_request_limit",		configure_http_request_limit },
+	{ "http_request_budget",	configure_http_request_budget },
+	{ "http_request_arena",		configure_http_request_arena },
+	{ "http_send_highwater",	configure_http_send_highwater },
+	{ "http_compress_min",		configure_http_compress_min },
+	{ "http_compress_level",	configure_http_compress_level },
+	{ "http_compress_types",	configure_http_compress_types },
 	{ "http_body_disk_offload",	configure_http_body_disk_offload },
 	{ "http_body_disk_path",	configure_http_body_disk_path },
 	{ "validator",			configure_validator },
@@ -197,6 +227,10 @@ kore_parse_config(void)
 	if (!kore_module_loaded())
 		fatal("no application module was loaded");
 
+#if !defined(KORE_NO_HTTP)
+	kore_domain_callback(kore_route_build);
+#endif
+
 	if (skip_chroot != 1 && chroot_path == NULL) {
 		fatal("missing a chroot path");
 	}
@@ -425,6 +459,39 @@ configure_tls_dhparam(char *path)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_tls_session_cache(char *option)
+{
+	int		err;
+
+	tls_session_cache = kore_strtonum(option, 10, 0, 1048576, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad tls_session_cache value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_tls_ktls(char *option)
+{
+	int		err;
+
+	tls_ktls = kore_strtonum(option, 10, 0, 1, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad tls_ktls value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+#if !defined(BIO_get_ktls_send)
+	if (tls_ktls)
+		printf("tls_ktls: not supported by this OpenSSL, ignoring\n");
+#endif
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_client_certificates(char *options)
 {
@@ -465,6 +532,20 @@ configure_rand_file(char *path)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_keymgr_workers(char *option)
+{
+	int		err;
+
+	keymgr_workers = kore_strtonum(option, 10, 1, 255, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("%s is not a valid keymgr_workers number\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_certfile(char *path)
 {
@@ -573,6 +654,60 @@ configure_handler(int type, char *options)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_filemap(char *options)
+{
+	char		*argv[4];
+
+	if (current_domain == NULL) {
+		printf("filemap not specified in domain context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_split_string(options, " ", argv, 4);
+
+	if (argv[0] == NULL || argv[1] == NULL) {
+		printf("missing parameters for filemap\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!kore_filemap_new(argv[0],
+	    current_domain->domain, argv[1], argv[2])) {
+		printf("cannot create filemap for %s\n", argv[0]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_filemap_cache(char *option)
+{
+	int		err;
+
+	kore_filemap_cache_max = kore_strtonum(option, 10, 2, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad filemap_cache value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_filemap_cache_ttl(char *option)
+{
+	int		err;
+
+	kore_filemap_cache_ttl = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad filemap_cache_ttl value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_accesslog(char *path)
 {
@@ -598,6 +733,32 @@ configure_accesslog(char *path)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_compress(char *path)
+{
+	struct kore_module_handle	*hdlr;
+
+	if (current_domain == NULL) {
+		printf("compress not specified in domain context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!strcmp(path, "*")) {
+		current_domain->compress = 1;
+		return (KORE_RESULT_OK);
+	}
+
+	TAILQ_FOREACH(hdlr, &(current_domain->handlers), list) {
+		if (!strcmp(hdlr->path, path)) {
+			hdlr->compress = 1;
+			return (KORE_RESULT_OK);
+		}
+	}
+
+	printf("compress for unknown page handler: %s\n", path);
+	return (KORE_RESULT_ERROR);
+}
+
 static int
 configure_http_header_max(char *option)
 {
@@ -692,6 +853,95 @@ configure_http_request_limit(char *option)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_http_request_budget(char *option)
+{
+	int		err;
+
+	http_request_budget = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad http_request_budget value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_request_arena(char *option)
+{
+	int		err;
+
+	http_request_arena = kore_strtonum(option, 10, 256, 1048576, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad http_request_arena value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_send_highwater(char *option)
+{
+	int		err;
+
+	http_send_highwater = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad http_send_highwater value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_compress_min(char *option)
+{
+	int		err;
+
+	http_compress_min = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad http_compress_min value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_compress_level(char *option)
+{
+	int		err;
+
+	http_compress_level = kore_strtonum(option, 10, 1, 9, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad http_compress_level value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_compress_types(char *options)
+{
+	int		i;
+	char		*argv[HTTP_COMPRESS_TYPES_MAX + 1];
+
+	kore_split_string(options, " ", argv, HTTP_COMPRESS_TYPES_MAX + 1);
+	if (argv[0] == NULL) {
+		printf("http_compress_types is missing a parameter\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	for (i = 0; argv[i] != NULL; i++)
+		http_compress_types[i] = kore_strdup(argv[i]);
+	http_compress_types[i] = NULL;
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_validator(char *name)
 {
@@ -1058,6 +1308,34 @@ configure_socket_backlog(char *option)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_socket_reuseport(char *option)
+{
+	int		err;
+
+	kore_socket_reuseport = kore_strtonum(option, 10, 0, 1, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad socket_reuseport value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_socket_reuseport_cpu(char *option)
+{
+	int		err;
+
+	kore_socket_reuseport_cpu = kore_strtonum(option, 10, 0, 1, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad socket_reuseport_cpu value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static void
 domain_tls_init(void)
 {
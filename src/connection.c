@@ -24,6 +24,23 @@
 #include "kore.h"
 #include "http.h"
 
+/*
+ * Connections with an active idle timer sit on the list for their idle
+ * length, ordered by when the timer was started. Only the head of each
+ * list has to be looked at to find out what has expired.
+ */
+struct kore_idle_list {
+	u_int64_t			length;
+	TAILQ_HEAD(, connection)	conns;
+	LIST_ENTRY(kore_idle_list)	list;
+};
+
+static struct kore_idle_list	*connection_idle_list(u_int64_t);
+static void			connection_accepted(struct listener *,
+				    struct connection *);
+
+static LIST_HEAD(, kore_idle_list)	idle_lists;
+
 struct kore_pool		connection_pool;
 struct connection_list		connections;
 struct connection_list		disconnected;
@@ -33,6 +50,7 @@ kore_connection_init(void)
 {
 	TAILQ_INIT(&connections);
 	TAILQ_INIT(&disconnected);
+	LIST_INIT(&idle_lists);
 
 	kore_pool_init(&connection_pool, "connection_pool",
 	    sizeof(struct connection), worker_max_connections);
@@ -41,11 +59,18 @@ kore_connection_init(void)
 void
 kore_connection_cleanup(void)
 {
+	struct kore_idle_list	*idle;
+
 	kore_debug("connection_cleanup()");
 
 	/* Drop all connections */
 	kore_connection_prune(KORE_CONNECTION_PRUNE_ALL);
 	kore_pool_cleanup(&connection_pool);
+
+	while ((idle = LIST_FIRST(&idle_lists)) != NULL) {
+		LIST_REMOVE(idle, list);
+		kore_free(idle);
+	}
 }
 
 struct connection *
@@ -65,11 +90,14 @@ kore_connection_new(void *owner)
 	c->snb = NULL;
 	c->owner = owner;
 	c->handle = NULL;
+	c->writev = NULL;
+	c->sendfile = NULL;
 	c->disconnect = NULL;
 	c->hdlr_extra = NULL;
 	c->proto = CONN_PROTO_UNKNOWN;
 	c->type = KORE_TYPE_CONNECTION;
 	c->idle_timer.start = 0;
+	c->idle_timer.bucket = NULL;
 	c->idle_timer.length = KORE_IDLE_TIMER_MAX;
 
 #if !defined(KORE_NO_HTTP)
@@ -117,6 +145,58 @@ kore_connection_accept(struct listener *listener, struct connection **out)
 		return (KORE_RESULT_ERROR);
 	}
 
+	connection_accepted(listener, c);
+
+	*out = c;
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Take over a connection the platform layer already accepted on our
+ * behalf. The descriptor must have been accepted as non-blocking.
+ */
+int
+kore_connection_accept_fd(struct listener *listener, int fd,
+    struct connection **out)
+{
+	struct connection	*c;
+	struct sockaddr		*s;
+	socklen_t		len;
+
+	kore_debug("kore_connection_accept_fd(%p, %d)", listener, fd);
+
+	*out = NULL;
+	c = kore_connection_new(listener);
+
+	c->fd = fd;
+	c->addrtype = listener->addrtype;
+	if (c->addrtype == AF_INET) {
+		len = sizeof(struct sockaddr_in);
+		s = (struct sockaddr *)&(c->addr.ipv4);
+	} else {
+		len = sizeof(struct sockaddr_in6);
+		s = (struct sockaddr *)&(c->addr.ipv6);
+	}
+
+	if (getpeername(c->fd, s, &len) == -1) {
+		kore_debug("getpeername(): %s", errno_s);
+		close(c->fd);
+		kore_pool_put(&connection_pool, c);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!kore_sockopt(c->fd, IPPROTO_TCP, TCP_NODELAY))
+		kore_log(LOG_NOTICE, "failed to set TCP_NODELAY on %d", c->fd);
+
+	connection_accepted(listener, c);
+
+	*out = c;
+	return (KORE_RESULT_OK);
+}
+
+static void
+connection_accepted(struct listener *listener, struct connection *c)
+{
 	c->handle = kore_connection_handle;
 	TAILQ_INSERT_TAIL(&connections, c, list);
 
@@ -127,6 +207,8 @@ kore_connection_accept(struct listener *listener, struct connection **out)
 #else
 	c->state = CONN_STATE_ESTABLISHED;
 	c->write = net_write;
+	c->writev = net_writev;
+	c->sendfile = kore_platform_sendfile;
 	c->read = net_read;
 
 	if (listener->connect != NULL) {
@@ -144,24 +226,22 @@ kore_connection_accept(struct listener *listener, struct connection **out)
 
 	kore_connection_start_idletimer(c);
 	worker_active_connections++;
-
-	*out = c;
-	return (KORE_RESULT_OK);
 }
 
 void
 kore_connection_check_timeout(void)
 {
 	struct connection	*c;
+	struct kore_idle_list	*idle;
 	u_int64_t		now;
 
-	now = kore_time_ms();
-	TAILQ_FOREACH(c, &connections, list) {
-		if (c->proto == CONN_PROTO_MSG)
-			continue;
-		if (!(c->flags & CONN_IDLE_TIMER_ACT))
-			continue;
-		kore_connection_check_idletimer(now, c);
+	now = kore_time_mono_ms();
+	LIST_FOREACH(idle, &idle_lists, list) {
+		while ((c = TAILQ_FIRST(&idle->conns)) != NULL) {
+			if ((now - c->idle_timer.start) < idle->length)
+				break;
+			kore_connection_check_idletimer(now, c);
+		}
 	}
 }
 
@@ -191,6 +271,7 @@ kore_connection_disconnect(struct connection *c)
 	if (c->state != CONN_STATE_DISCONNECTING) {
 		kore_debug("preparing %p for disconnection", c);
 		c->state = CONN_STATE_DISCONNECTING;
+		kore_connection_stop_idletimer(c);
 		if (c->disconnect)
 			c->disconnect(c);
 
@@ -227,12 +308,15 @@ kore_connection_handle(struct connection *c)
 		}
 
 		ERR_clear_error();
-		r = SSL_accept(c->ssl);
+		r = kore_domain_tls_accept(c);
 		if (r <= 0) {
 			r = SSL_get_error(c->ssl, r);
 			switch (r) {
 			case SSL_ERROR_WANT_READ:
 			case SSL_ERROR_WANT_WRITE:
+#if !defined(LIBRESSL_VERSION_TEXT) && OPENSSL_VERSION_NUMBER >= 0x10100000L
+			case SSL_ERROR_WANT_ASYNC:
+#endif
 				return (KORE_RESULT_OK);
 			default:
 				kore_debug("SSL_accept(): %s", ssl_errno_s);
@@ -257,6 +341,11 @@ kore_connection_handle(struct connection *c)
 			c->cert = NULL;
 		}
 
+#if !defined(LIBRESSL_VERSION_TEXT) && OPENSSL_VERSION_NUMBER >= 0x10100000L
+		/* Only the handshake needs to run inside of an async job. */
+		SSL_clear_mode(c->ssl, SSL_MODE_ASYNC);
+#endif
+
 		r = SSL_get_verify_result(c->ssl);
 		if (r != X509_V_OK) {
 			kore_debug("SSL_get_verify_result(): %d, %s",
@@ -264,6 +353,19 @@ kore_connection_handle(struct connection *c)
 			return (KORE_RESULT_ERROR);
 		}
 
+#if defined(BIO_get_ktls_send)
+		/*
+		 * If the kernel took over encryption we can write to the
+		 * socket directly and send files with sendfile(). Reads stay
+		 * with SSL_read() as it has to deal with non-data records.
+		 */
+		if (BIO_get_ktls_send(SSL_get_wbio(c->ssl))) {
+			c->write = net_write;
+			c->writev = net_writev;
+			c->sendfile = kore_platform_sendfile;
+		}
+#endif
+
 		if (c->owner != NULL) {
 			listener = (struct listener *)c->owner;
 			if (listener->connect != NULL) {
@@ -321,6 +423,7 @@ kore_connection_remove(struct connection *c)
 
 #if !defined(KORE_NO_TLS)
 	if (c->ssl != NULL) {
+		kore_domain_keymgr_cancel(c);
 		SSL_shutdown(c->ssl);
 		SSL_free(c->ssl);
 	}
@@ -329,6 +432,7 @@ kore_connection_remove(struct connection *c)
 		X509_free(c->cert);
 #endif
 
+	kore_platform_event_remove(c->fd);
 	close(c->fd);
 
 	if (c->hdlr_extra != NULL)
@@ -352,11 +456,13 @@ kore_connection_remove(struct connection *c)
 	for (nb = TAILQ_FIRST(&(c->send_queue)); nb != NULL; nb = next) {
 		next = TAILQ_NEXT(nb, list);
 		TAILQ_REMOVE(&(c->send_queue), nb, list);
-		if (!(nb->flags & NETBUF_IS_STREAM)) {
+		if (!(nb->flags & (NETBUF_IS_STREAM | NETBUF_IS_FILE))) {
 			kore_free(nb->buf);
 		} else if (nb->cb != NULL) {
 			(void)nb->cb(nb);
 		}
+		if (nb->flags & NETBUF_IS_FILE)
+			(void)close(nb->fd);
 		kore_pool_put(&nb_pool, nb);
 	}
 
@@ -386,8 +492,19 @@ kore_connection_start_idletimer(struct connection *c)
 {
 	kore_debug("kore_connection_start_idletimer(%p)", c);
 
+	if (c->idle_timer.bucket != NULL) {
+		TAILQ_REMOVE(&c->idle_timer.bucket->conns, c, idle_timer.list);
+		c->idle_timer.bucket = NULL;
+	}
+
 	c->flags |= CONN_IDLE_TIMER_ACT;
-	c->idle_timer.start = kore_time_ms();
+	c->idle_timer.start = kore_time_mono_ms();
+
+	if (c->proto == CONN_PROTO_MSG || c->state == CONN_STATE_DISCONNECTING)
+		return;
+
+	c->idle_timer.bucket = connection_idle_list(c->idle_timer.length);
+	TAILQ_INSERT_TAIL(&c->idle_timer.bucket->conns, c, idle_timer.list);
 }
 
 void
@@ -397,6 +514,11 @@ kore_connection_stop_idletimer(struct connection *c)
 
 	c->flags &= ~CONN_IDLE_TIMER_ACT;
 	c->idle_timer.start = 0;
+
+	if (c->idle_timer.bucket != NULL) {
+		TAILQ_REMOVE(&c->idle_timer.bucket->conns, c, idle_timer.list);
+		c->idle_timer.bucket = NULL;
+	}
 }
 
 int
@@ -426,3 +548,21 @@ kore_connection_nonblock(int fd, int nodelay)
 
 	return (KORE_RESULT_OK);
 }
+
+static struct kore_idle_list *
+connection_idle_list(u_int64_t length)
+{
+	struct kore_idle_list	*idle;
+
+	LIST_FOREACH(idle, &idle_lists, list) {
+		if (idle->length == length)
+			return (idle);
+	}
+
+	idle = kore_malloc(sizeof(*idle));
+	idle->length = length;
+	TAILQ_INIT(&idle->conns);
+	LIST_INSERT_HEAD(&idle_lists, idle, list);
+
+	return (idle);
+}
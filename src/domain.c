@@ -27,6 +27,11 @@
 #include <openssl/evp.h>
 #include <openssl/ec.h>
 #include <openssl/ecdsa.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#if !defined(LIBRESSL_VERSION_TEXT) && OPENSSL_VERSION_NUMBER >= 0x10100000L
+#include <openssl/async.h>
+#endif
 #include <poll.h>
 #endif
 
@@ -40,15 +45,71 @@
 
 #define SSL_SESSION_ID		"kore_ssl_sessionid"
 
+#if !defined(KORE_NO_TLS)
+#define TLS_SESSION_DER_MAX	1024
+#endif
+
 struct kore_domain_h		domains;
 struct kore_domain		*primary_dom = NULL;
 
 #if !defined(KORE_NO_TLS)
+#define KEYMGR_OP_DONE		0x0001
+#define KEYMGR_OP_CANCELLED	0x0002
+#define KEYMGR_OP_PARKED	0x0004
+
+#define KEYMGR_OP_TIMEOUT	1000
+
+/*
+ * A private key operation that was sent to one of the keymgrs and is
+ * awaiting its answer, matched back to us by its id.
+ */
+struct keymgr_op {
+	u_int32_t		id;
+	int			flags;
+	u_int64_t		start;
+	struct connection	*c;
+	size_t			len;
+	u_int8_t		buf[1024];
+	TAILQ_ENTRY(keymgr_op)	list;
+};
+
+/*
+ * The session cache shared between all workers, it lives in the shm
+ * segment set up in kore_worker_init(). Each slot is protected by its
+ * own lock that is only ever tried, never waited on.
+ */
+struct tls_session_slot {
+	volatile int		lock;
+	time_t			expires;
+	u_int8_t		id_len;
+	u_int8_t		id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	u_int16_t		der_len;
+	u_int8_t		der[TLS_SESSION_DER_MAX];
+};
+
+struct tls_session_cache {
+	volatile u_int64_t	session_hits;
+	volatile u_int64_t	session_misses;
+	volatile u_int64_t	ticket_hits;
+	volatile u_int64_t	ticket_misses;
+	u_int32_t		slots;
+	struct tls_session_slot	slot[];
+};
+
+u_int32_t			tls_session_cache = 1024;
+
+static struct tls_session_cache	*tls_cache = NULL;
+static int			tls_ticket_keys_set = 0;
+static struct kore_ticket_key	tls_ticket_keys[KORE_TICKET_KEYS];
+
 static u_int8_t			keymgr_buf[2048];
-static size_t			keymgr_buflen = 0;
-static int			keymgr_response = 0;
+static u_int32_t		keymgr_op_id = 0;
+static u_int8_t			keymgr_next = 0;
+static struct connection	*keymgr_conn = NULL;
+static TAILQ_HEAD(, keymgr_op)	keymgr_ops;
 DH				*tls_dhparam = NULL;
 int				tls_version = KORE_TLS_VERSION_1_2;
+int				tls_ktls = 0;
 #endif
 
 static void	domain_load_crl(struct kore_domain *);
@@ -56,9 +117,26 @@ static void	domain_load_crl(struct kore_domain *);
 #if !defined(KORE_NO_TLS)
 static int	domain_x509_verify(int, X509_STORE_CTX *);
 
+static struct tls_session_slot	*tls_session_slot(const u_int8_t *,
+				    unsigned int);
+static void	tls_session_slot_release(struct tls_session_slot *);
+static int	tls_session_new(SSL *, SSL_SESSION *);
+static void	tls_session_remove(SSL_CTX *, SSL_SESSION *);
+#if !defined(LIBRESSL_VERSION_TEXT) && OPENSSL_VERSION_NUMBER >= 0x10100000L
+static SSL_SESSION	*tls_session_get(SSL *, const unsigned char *,
+			    int, int *);
+#else
+static SSL_SESSION	*tls_session_get(SSL *, unsigned char *, int, int *);
+#endif
+static int	tls_ticket_key_cb(SSL *, unsigned char *, unsigned char *,
+		    EVP_CIPHER_CTX *, HMAC_CTX *, int);
+static void	tls_ticket_keys_recv(struct kore_msg *, const void *);
+
 static void	keymgr_init(void);
-static void	keymgr_await_data(void);
+static void	keymgr_await_data(struct keymgr_op *);
 static void	keymgr_msg_response(struct kore_msg *, const void *);
+static struct keymgr_op	*keymgr_request(struct kore_keyreq *, size_t);
+static int		keymgr_op_wait(struct keymgr_op *);
 
 static int	keymgr_rsa_init(RSA *);
 static int	keymgr_rsa_finish(RSA *);
@@ -154,6 +232,11 @@ kore_domain_cleanup(void)
 		kore_domain_free(dom);
 	}
 
+#if !defined(KORE_NO_TLS)
+	OPENSSL_cleanse(tls_ticket_keys, sizeof(tls_ticket_keys));
+	tls_ticket_keys_set = 0;
+#endif
+
 #if !defined(LIBRESSL_VERSION_TEXT) && OPENSSL_VERSION_NUMBER >= 0x10100000L
 	if (keymgr_rsa_meth != NULL) {
 		RSA_meth_free(keymgr_rsa_meth);
@@ -179,12 +262,16 @@ kore_domain_new(char *domain)
 
 	dom = kore_malloc(sizeof(*dom));
 	dom->accesslog = -1;
+	dom->compress = 0;
 #if !defined(KORE_NO_TLS)
 	dom->cafile = NULL;
 	dom->certkey = NULL;
 	dom->ssl_ctx = NULL;
 	dom->certfile = NULL;
 	dom->crlfile = NULL;
+#endif
+#if !defined(KORE_NO_HTTP)
+	dom->routes = NULL;
 #endif
 	dom->domain = kore_strdup(domain);
 	TAILQ_INIT(&(dom->handlers));
@@ -227,6 +314,8 @@ kore_domain_free(struct kore_domain *dom)
 #endif
 
 #if !defined(KORE_NO_HTTP)
+	kore_route_free(dom);
+
 	/* Drop all handlers associated with this domain */
 	while ((hdlr = TAILQ_FIRST(&(dom->handlers))) != NULL) {
 		TAILQ_REMOVE(&(dom->handlers), hdlr, list);
@@ -385,6 +474,19 @@ kore_domain_tlsinit(struct kore_domain *dom)
 	SSL_CTX_set_session_id_context(dom->ssl_ctx,
 	    (unsigned char *)SSL_SESSION_ID, strlen(SSL_SESSION_ID));
 
+	/*
+	 * Sessions are kept in a cache shared by all workers and tickets
+	 * are protected with keys handed out by the keymgr so a client
+	 * can resume its session on whatever worker it ends up on.
+	 */
+	SSL_CTX_set_session_cache_mode(dom->ssl_ctx,
+	    SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+	SSL_CTX_sess_set_new_cb(dom->ssl_ctx, tls_session_new);
+	SSL_CTX_sess_set_get_cb(dom->ssl_ctx, tls_session_get);
+	SSL_CTX_sess_set_remove_cb(dom->ssl_ctx, tls_session_remove);
+
+	SSL_CTX_set_tlsext_ticket_key_cb(dom->ssl_ctx, tls_ticket_key_cb);
+
 	/*
 	 * Force OpenSSL to not use its freelists. Even without using
 	 * SSL_MODE_RELEASE_BUFFERS there are times it will use the
@@ -401,6 +503,15 @@ kore_domain_tlsinit(struct kore_domain *dom)
 #endif
 	SSL_CTX_set_mode(dom->ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
 
+#if !defined(LIBRESSL_VERSION_TEXT) && OPENSSL_VERSION_NUMBER >= 0x10100000L
+	/*
+	 * Run handshakes inside of async jobs so that connections waiting
+	 * on the keymgr can be parked instead of blocking the worker.
+	 */
+	if (ASYNC_is_capable())
+		SSL_CTX_set_mode(dom->ssl_ctx, SSL_MODE_ASYNC);
+#endif
+
 	if (tls_version == KORE_TLS_VERSION_BOTH) {
 		SSL_CTX_set_options(dom->ssl_ctx, SSL_OP_NO_SSLv2);
 		SSL_CTX_set_options(dom->ssl_ctx, SSL_OP_NO_SSLv3);
@@ -408,6 +519,10 @@ kore_domain_tlsinit(struct kore_domain *dom)
 	}
 
 	SSL_CTX_set_options(dom->ssl_ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+#if defined(BIO_get_ktls_send)
+	if (tls_ktls)
+		SSL_CTX_set_options(dom->ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
 	SSL_CTX_set_cipher_list(dom->ssl_ctx, kore_tls_cipher_list);
 
 	SSL_CTX_set_info_callback(dom->ssl_ctx, kore_tls_info_callback);
@@ -469,10 +584,106 @@ kore_domain_keymgr_init(void)
 {
 #if !defined(KORE_NO_TLS)
 	keymgr_init();
+	TAILQ_INIT(&keymgr_ops);
 	kore_msg_register(KORE_MSG_KEYMGR_RESP, keymgr_msg_response);
+	kore_msg_register(KORE_MSG_TICKET_KEYS, tls_ticket_keys_recv);
+#endif
+}
+
+#if !defined(KORE_NO_TLS)
+int
+kore_domain_tls_accept(struct connection *c)
+{
+	int		r;
+
+	/*
+	 * Remember who is doing the handshake so that any private key
+	 * operation started from inside SSL_accept() can be tied to it.
+	 */
+	keymgr_conn = c;
+	r = SSL_accept(c->ssl);
+	keymgr_conn = NULL;
+
+	return (r);
+}
+
+size_t
+kore_domain_tls_cache_len(void)
+{
+	return (sizeof(struct tls_session_cache) +
+	    (sizeof(struct tls_session_slot) * tls_session_cache));
+}
+
+void
+kore_domain_tls_cache_init(void *mem)
+{
+	tls_cache = mem;
+	memset(tls_cache, 0, kore_domain_tls_cache_len());
+	tls_cache->slots = tls_session_cache;
+}
+
+void
+kore_domain_tls_stats(struct kore_tls_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	if (tls_cache == NULL)
+		return;
+
+	stats->session_hits = tls_cache->session_hits;
+	stats->session_misses = tls_cache->session_misses;
+	stats->ticket_hits = tls_cache->ticket_hits;
+	stats->ticket_misses = tls_cache->ticket_misses;
+}
+
+void
+kore_domain_keymgr_cancel(struct connection *c)
+{
+	struct keymgr_op	*op;
+
+	TAILQ_FOREACH(op, &keymgr_ops, list) {
+		if (op->c == c) {
+			op->c = NULL;
+			op->flags |= KEYMGR_OP_CANCELLED;
+		}
+	}
+
+#if !defined(LIBRESSL_VERSION_TEXT) && OPENSSL_VERSION_NUMBER >= 0x10100000L
+	/* Let the parked job run to completion so OpenSSL can clean it up. */
+	if (c->ssl != NULL && SSL_waiting_for_async(c->ssl))
+		(void)kore_domain_tls_accept(c);
 #endif
 }
 
+/*
+ * Give up on parked operations the keymgr has not answered in time, just
+ * like the blocking path does. Resuming the job fails the handshake.
+ */
+void
+kore_domain_keymgr_timeout(void)
+{
+	u_int64_t		now;
+	struct connection	*c;
+	struct keymgr_op	*op, *next;
+
+	now = kore_time_mono_ms();
+	for (op = TAILQ_FIRST(&keymgr_ops); op != NULL; op = next) {
+		if ((now - op->start) < KEYMGR_OP_TIMEOUT)
+			break;
+
+		next = TAILQ_NEXT(op, list);
+		if (!(op->flags & KEYMGR_OP_PARKED) ||
+		    (op->flags & KEYMGR_OP_CANCELLED) || (c = op->c) == NULL)
+			continue;
+
+		kore_debug("keymgr op %u timed out for %p", op->id, c);
+		op->flags |= KEYMGR_OP_CANCELLED;
+		if (c->state == CONN_STATE_TLS_SHAKE && !c->handle(c))
+			kore_connection_disconnect(c);
+	}
+}
+#endif
+
 static void
 domain_load_crl(struct kore_domain *dom)
 {
@@ -547,6 +758,7 @@ keymgr_rsa_privenc(int flen, const unsigned char *from, unsigned char *to,
 {
 	int			ret;
 	size_t			len;
+	struct keymgr_op	*op;
 	struct kore_keyreq	*req;
 	struct kore_domain	*dom;
 
@@ -569,21 +781,17 @@ keymgr_rsa_privenc(int flen, const unsigned char *from, unsigned char *to,
 	memcpy(&req->data[0], from, req->data_len);
 	memcpy(req->domain, dom->domain, req->domain_len);
 
-	kore_msg_send(KORE_WORKER_KEYMGR, KORE_MSG_KEYMGR_REQ, keymgr_buf, len);
-	keymgr_await_data();
+	op = keymgr_request(req, len);
+	if (!keymgr_op_wait(op))
+		return (-1);
 
 	ret = -1;
-	if (keymgr_response) {
-		if (keymgr_buflen < INT_MAX &&
-		    (int)keymgr_buflen == RSA_size(rsa)) {
-			ret = RSA_size(rsa);
-			memcpy(to, keymgr_buf, RSA_size(rsa));
-		}
+	if (op->len < INT_MAX && (int)op->len == RSA_size(rsa)) {
+		ret = RSA_size(rsa);
+		memcpy(to, op->buf, RSA_size(rsa));
 	}
 
-	keymgr_buflen = 0;
-	keymgr_response = 0;
-	kore_platform_event_all(worker->msg[1]->fd, worker->msg[1]);
+	kore_free(op);
 
 	return (ret);
 }
@@ -601,6 +809,7 @@ keymgr_ecdsa_sign(const unsigned char *dgst, int dgst_len,
 	size_t				len;
 	ECDSA_SIG			*sig;
 	const u_int8_t			*ptr;
+	struct keymgr_op		*op;
 	struct kore_domain		*dom;
 	struct kore_keyreq		*req;
 
@@ -628,25 +837,87 @@ keymgr_ecdsa_sign(const unsigned char *dgst, int dgst_len,
 	memcpy(&req->data[0], dgst, req->data_len);
 	memcpy(req->domain, dom->domain, req->domain_len);
 
-	kore_msg_send(KORE_WORKER_KEYMGR, KORE_MSG_KEYMGR_REQ, keymgr_buf, len);
-	keymgr_await_data();
+	op = keymgr_request(req, len);
+	if (!keymgr_op_wait(op))
+		return (NULL);
+
+	ptr = op->buf;
+	sig = d2i_ECDSA_SIG(NULL, &ptr, op->len);
+	kore_free(op);
+
+	return (sig);
+}
+
+static struct keymgr_op *
+keymgr_request(struct kore_keyreq *req, size_t len)
+{
+	struct keymgr_op	*op;
+
+	op = kore_malloc(sizeof(*op));
+	op->len = 0;
+	op->flags = 0;
+	op->c = keymgr_conn;
+	op->id = keymgr_op_id++;
+	op->start = kore_time_mono_ms();
+	TAILQ_INSERT_TAIL(&keymgr_ops, op, list);
+
+	/* Spread requests across all available keymgrs. */
+	req->id = op->id;
+	kore_msg_send(kore_worker_keymgr_id(keymgr_next),
+	    KORE_MSG_KEYMGR_REQ, req, len);
+
+	if (++keymgr_next >= keymgr_workers)
+		keymgr_next = 0;
+
+	return (op);
+}
 
-	if (keymgr_response) {
-		ptr = keymgr_buf;
-		sig = d2i_ECDSA_SIG(NULL, &ptr, keymgr_buflen);
+/*
+ * Wait for a keymgr to answer the given operation.
+ *
+ * If we are running inside of an OpenSSL async job (SSL_MODE_ASYNC) we
+ * pause the job, SSL_accept() returns SSL_ERROR_WANT_ASYNC and the
+ * connection stays parked in CONN_STATE_TLS_SHAKE while the worker
+ * goes on serving others. The job is resumed by keymgr_msg_response().
+ *
+ * Otherwise we fall back to blocking on the msg channel.
+ *
+ * Returns KORE_RESULT_OK if op holds an answer, which the caller must
+ * free. On error the op is already gone.
+ */
+static int
+keymgr_op_wait(struct keymgr_op *op)
+{
+#if !defined(LIBRESSL_VERSION_TEXT) && OPENSSL_VERSION_NUMBER >= 0x10100000L
+	if (op->c != NULL && ASYNC_get_current_job() != NULL) {
+		op->flags |= KEYMGR_OP_PARKED;
+		while (!(op->flags & (KEYMGR_OP_DONE | KEYMGR_OP_CANCELLED))) {
+			if (!ASYNC_pause_job())
+				break;
+		}
 	} else {
-		sig = NULL;
+		keymgr_await_data(op);
 	}
+#else
+	keymgr_await_data(op);
+#endif
 
-	keymgr_buflen = 0;
-	keymgr_response = 0;
-	kore_platform_event_all(worker->msg[1]->fd, worker->msg[1]);
+	if (!(op->flags & KEYMGR_OP_DONE)) {
+		TAILQ_REMOVE(&keymgr_ops, op, list);
+		kore_free(op);
+		return (KORE_RESULT_ERROR);
+	}
 
-	return (sig);
+	if (op->len == 0) {
+		kore_free(op);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
 }
 
 static void
-keymgr_await_data(void)
+keymgr_await_data(struct keymgr_op *op)
 {
 	int			ret;
 	struct pollfd		pfd[1];
@@ -673,12 +944,9 @@ keymgr_await_data(void)
 	 * while existing requests will get processed until we return
 	 * from this call.
 	 */
-	start = kore_time_ms();
+	start = kore_time_update();
 	kore_platform_disable_read(worker->msg[1]->fd);
 
-	keymgr_response = 0;
-	memset(keymgr_buf, 0, sizeof(keymgr_buf));
-
 #if !defined(KORE_NO_HTTP)
 	process_requests = 0;
 #endif
@@ -701,7 +969,7 @@ keymgr_await_data(void)
 			fatal("poll: %s", errno_s);
 		}
 
-		cur = kore_time_ms();
+		cur = kore_time_update();
 		if ((cur - start) > 1000)
 			break;
 
@@ -722,7 +990,7 @@ keymgr_await_data(void)
 		if (!net_recv_flush(worker->msg[1]))
 			break;
 
-		if (keymgr_response)
+		if (op->flags & KEYMGR_OP_DONE)
 			break;
 
 #if !defined(KORE_NO_HTTP)
@@ -732,18 +1000,231 @@ keymgr_await_data(void)
 		}
 #endif
 	}
+
+	kore_platform_event_all(worker->msg[1]->fd, worker->msg[1]);
 }
 
 static void
 keymgr_msg_response(struct kore_msg *msg, const void *data)
 {
-	keymgr_response = 1;
-	keymgr_buflen = msg->length;
+	struct connection		*c;
+	struct keymgr_op		*op;
+	const struct kore_keyres	*res;
+
+	if (msg->length < sizeof(*res))
+		return;
 
-	if (keymgr_buflen > sizeof(keymgr_buf))
+	res = (const struct kore_keyres *)data;
+	if (msg->length != sizeof(*res) + res->data_len)
 		return;
 
-	memcpy(keymgr_buf, data, keymgr_buflen);
+	/* Answers for operations that were given up on are dropped. */
+	TAILQ_FOREACH(op, &keymgr_ops, list) {
+		if (op->id == res->id)
+			break;
+	}
+
+	if (op == NULL || (op->flags & KEYMGR_OP_CANCELLED))
+		return;
+
+	TAILQ_REMOVE(&keymgr_ops, op, list);
+
+	op->flags |= KEYMGR_OP_DONE;
+	if (res->data_len <= sizeof(op->buf)) {
+		op->len = res->data_len;
+		if (op->len > 0)
+			memcpy(op->buf, res->data, op->len);
+	}
+
+	/* Resume the handshake that was parked on this operation. */
+	if ((op->flags & KEYMGR_OP_PARKED) && (c = op->c) != NULL &&
+	    c->state == CONN_STATE_TLS_SHAKE) {
+		if (!c->handle(c))
+			kore_connection_disconnect(c);
+	}
+}
+
+static struct tls_session_slot *
+tls_session_slot(const u_int8_t *id, unsigned int len)
+{
+	u_int32_t		hash;
+	struct tls_session_slot	*slot;
+
+	if (tls_cache == NULL || tls_cache->slots == 0)
+		return (NULL);
+
+	if (len == 0 || len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+		return (NULL);
+
+	/* Session ids are random, the first bytes are a fine hash. */
+	hash = 0;
+	memcpy(&hash, id, MIN(len, sizeof(hash)));
+
+	slot = &tls_cache->slot[hash % tls_cache->slots];
+	if (!__sync_bool_compare_and_swap(&slot->lock, 0, 1))
+		return (NULL);
+
+	return (slot);
+}
+
+static void
+tls_session_slot_release(struct tls_session_slot *slot)
+{
+	__sync_lock_release(&slot->lock);
+}
+
+static int
+tls_session_new(SSL *ssl, SSL_SESSION *sess)
+{
+	int			len;
+	u_int8_t		*p;
+	const u_int8_t		*id;
+	unsigned int		id_len;
+	struct tls_session_slot	*slot;
+
+	if ((len = i2d_SSL_SESSION(sess, NULL)) <= 0 ||
+	    len > TLS_SESSION_DER_MAX)
+		return (0);
+
+	id = SSL_SESSION_get_id(sess, &id_len);
+	if ((slot = tls_session_slot(id, id_len)) == NULL)
+		return (0);
+
+	p = slot->der;
+	slot->der_len = i2d_SSL_SESSION(sess, &p);
+	slot->id_len = id_len;
+	slot->expires = SSL_SESSION_get_time(sess) +
+	    SSL_SESSION_get_timeout(sess);
+	memcpy(slot->id, id, id_len);
+
+	tls_session_slot_release(slot);
+
+	/* We keep our own copy, OpenSSL may drop its reference. */
+	return (0);
+}
+
+static SSL_SESSION *
+#if !defined(LIBRESSL_VERSION_TEXT) && OPENSSL_VERSION_NUMBER >= 0x10100000L
+tls_session_get(SSL *ssl, const unsigned char *id, int len, int *copy)
+#else
+tls_session_get(SSL *ssl, unsigned char *id, int len, int *copy)
+#endif
+{
+	size_t			der_len;
+	const u_int8_t		*p;
+	SSL_SESSION		*sess;
+	struct tls_session_slot	*slot;
+	u_int8_t		der[TLS_SESSION_DER_MAX];
+
+	*copy = 0;
+	der_len = 0;
+
+	if (len > 0 && (slot = tls_session_slot(id, len)) != NULL) {
+		if (slot->id_len == len && !memcmp(slot->id, id, len) &&
+		    slot->expires > time(NULL)) {
+			der_len = slot->der_len;
+			memcpy(der, slot->der, der_len);
+		}
+		tls_session_slot_release(slot);
+	}
+
+	sess = NULL;
+	if (der_len > 0) {
+		p = der;
+		sess = d2i_SSL_SESSION(NULL, &p, der_len);
+	}
+
+	if (tls_cache != NULL) {
+		if (sess != NULL)
+			__sync_fetch_and_add(&tls_cache->session_hits, 1);
+		else
+			__sync_fetch_and_add(&tls_cache->session_misses, 1);
+	}
+
+	return (sess);
+}
+
+static void
+tls_session_remove(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+	const u_int8_t		*id;
+	unsigned int		id_len;
+	struct tls_session_slot	*slot;
+
+	id = SSL_SESSION_get_id(sess, &id_len);
+	if ((slot = tls_session_slot(id, id_len)) == NULL)
+		return;
+
+	if (slot->id_len == id_len && !memcmp(slot->id, id, id_len)) {
+		slot->id_len = 0;
+		slot->der_len = 0;
+	}
+
+	tls_session_slot_release(slot);
+}
+
+static int
+tls_ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+    EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc)
+{
+	int			i;
+	struct kore_ticket_key	*key;
+
+	/* Until the keymgr gave us keys, no tickets are issued. */
+	if (!tls_ticket_keys_set)
+		return (0);
+
+	if (enc) {
+		key = &tls_ticket_keys[0];
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+			return (-1);
+
+		memcpy(name, key->name, sizeof(key->name));
+		if (!EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(),
+		    NULL, key->aes_key, iv))
+			return (-1);
+		if (!HMAC_Init_ex(hctx, key->hmac_key,
+		    sizeof(key->hmac_key), EVP_sha256(), NULL))
+			return (-1);
+
+		return (1);
+	}
+
+	for (i = 0; i < KORE_TICKET_KEYS; i++) {
+		key = &tls_ticket_keys[i];
+		if (memcmp(name, key->name, sizeof(key->name)))
+			continue;
+
+		if (!EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(),
+		    NULL, key->aes_key, iv))
+			return (-1);
+		if (!HMAC_Init_ex(hctx, key->hmac_key,
+		    sizeof(key->hmac_key), EVP_sha256(), NULL))
+			return (-1);
+
+		if (tls_cache != NULL)
+			__sync_fetch_and_add(&tls_cache->ticket_hits, 1);
+
+		/* Tickets under the previous key get renewed. */
+		return ((i == 0) ? 1 : 2);
+	}
+
+	if (tls_cache != NULL)
+		__sync_fetch_and_add(&tls_cache->ticket_misses, 1);
+
+	return (0);
+}
+
+static void
+tls_ticket_keys_recv(struct kore_msg *msg, const void *data)
+{
+	if (msg->length != sizeof(tls_ticket_keys)) {
+		kore_log(LOG_WARNING, "invalid ticket keys from keymgr");
+		return;
+	}
+
+	memcpy(tls_ticket_keys, data, sizeof(tls_ticket_keys));
+	tls_ticket_keys_set = 1;
 }
 
 static int
@@ -0,0 +1,612 @@
+/*
+ * Copyright (c) 2017 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Serve a directory tree under a path prefix. Every worker keeps an LRU
+ * cache of open file descriptors together with their stat(2) metadata
+ * so that a hit costs a dup(2) and a sendfile(2) instead of a path walk.
+ * Entries are revalidated with a stat(2) once they are older than
+ * filemap_cache_ttl, missing files are cached as well.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+
+#include "kore.h"
+#include "http.h"
+
+#define FILEMAP_BUCKETS_MIN	64
+
+struct filemap_entry {
+	char				*path;
+	u_int32_t			hash;
+	int				fd;
+	ino_t				ino;
+	off_t				size;
+	time_t				mtime;
+	u_int64_t			checked;
+	const char			*type;
+	char				etag[64];
+	char				lastmod[32];
+	LIST_ENTRY(filemap_entry)	hlist;
+	TAILQ_ENTRY(filemap_entry)	lru;
+};
+
+static const struct {
+	const char	*ext;
+	const char	*type;
+} filemap_types[] = {
+	{ "html",	"text/html; charset=utf-8" },
+	{ "htm",	"text/html; charset=utf-8" },
+	{ "css",	"text/css; charset=utf-8" },
+	{ "js",		"application/javascript; charset=utf-8" },
+	{ "json",	"application/json" },
+	{ "txt",	"text/plain; charset=utf-8" },
+	{ "xml",	"application/xml" },
+	{ "svg",	"image/svg+xml" },
+	{ "png",	"image/png" },
+	{ "jpg",	"image/jpeg" },
+	{ "jpeg",	"image/jpeg" },
+	{ "gif",	"image/gif" },
+	{ "webp",	"image/webp" },
+	{ "ico",	"image/x-icon" },
+	{ "pdf",	"application/pdf" },
+	{ "wasm",	"application/wasm" },
+	{ "woff",	"font/woff" },
+	{ "woff2",	"font/woff2" },
+	{ "mp4",	"video/mp4" },
+	{ "webm",	"video/webm" },
+	{ "mp3",	"audio/mpeg" },
+	{ NULL,		NULL },
+};
+
+static void		filemap_init(void);
+static u_int32_t	filemap_hash(const char *);
+static void		filemap_open(struct filemap_entry *, u_int64_t);
+static void		filemap_revalidate(struct filemap_entry *, u_int64_t);
+static void		filemap_evict(void);
+static const char	*filemap_type(const char *);
+static int		filemap_resolve(struct kore_module_handle *,
+			    const char *, char *, size_t);
+static int		filemap_range(const char *, off_t, off_t *, off_t *);
+static const char	*filemap_range_num(const char *, u_int64_t *);
+static int		filemap_if_range(struct http_request *,
+			    struct filemap_entry *);
+static struct filemap_entry	*filemap_lookup(const char *);
+
+u_int32_t	kore_filemap_cache_max = KORE_FILEMAP_CACHE_MAX;
+u_int64_t	kore_filemap_cache_ttl = KORE_FILEMAP_CACHE_TTL;
+
+static LIST_HEAD(, filemap_entry)	*filemap_buckets = NULL;
+static TAILQ_HEAD(filemap_lru_head, filemap_entry)	filemap_lru;
+static u_int32_t			filemap_mask = 0;
+static u_int32_t			filemap_count = 0;
+
+int
+kore_filemap_new(const char *path, const char *domain, const char *root,
+    const char *auth)
+{
+	struct stat			st;
+	struct kore_auth		*ap;
+	struct kore_domain		*dom;
+	struct kore_module_handle	*hdlr;
+	char				rpath[PATH_MAX];
+
+	kore_debug("kore_filemap_new(%s, %s, %s, %s)", path, domain,
+	    root, auth);
+
+	if ((dom = kore_domain_lookup(domain)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (*path != '/') {
+		kore_log(LOG_ERR, "filemap path '%s' must start with /", path);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (realpath(root, rpath) == NULL || stat(rpath, &st) == -1) {
+		kore_log(LOG_ERR, "filemap root '%s': %s", root, errno_s);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		kore_log(LOG_ERR, "filemap root '%s' is not a directory", root);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (auth != NULL) {
+		if ((ap = kore_auth_lookup(auth)) == NULL)
+			fatal("no authentication block '%s' found", auth);
+	} else {
+		ap = NULL;
+	}
+
+	hdlr = kore_malloc(sizeof(*hdlr));
+	hdlr->auth = ap;
+	hdlr->dom = dom;
+	hdlr->compress = 0;
+	hdlr->errors = 0;
+	hdlr->rcall = NULL;
+	hdlr->type = HANDLER_TYPE_FILEMAP;
+	hdlr->path = kore_strdup(path);
+	hdlr->func = kore_strdup("filemap");
+	hdlr->root = kore_strdup(rpath);
+
+	TAILQ_INIT(&(hdlr->params));
+	TAILQ_INSERT_TAIL(&(dom->handlers), hdlr, list);
+	kore_route_free(dom);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Returns 1 if path falls under the prefix of the filemap handler.
+ */
+int
+kore_filemap_match(struct kore_module_handle *hdlr, const char *path)
+{
+	size_t		len;
+
+	len = strlen(hdlr->path);
+	if (strncmp(hdlr->path, path, len))
+		return (0);
+
+	if (hdlr->path[len - 1] == '/' || path[len] == '\0' ||
+	    path[len] == '/')
+		return (1);
+
+	return (0);
+}
+
+int
+kore_filemap_serve(struct http_request *req)
+{
+	int				fd, status;
+	size_t				plen;
+	off_t				off, len;
+	const char			*type;
+	struct kore_module_handle	*hdlr;
+	struct filemap_entry		*fe, *gz;
+	char				*hdr, path[PATH_MAX];
+
+	hdlr = req->hdlr;
+
+	if (req->method != HTTP_METHOD_GET &&
+	    req->method != HTTP_METHOD_HEAD) {
+		http_response_header(req, "allow", "get, head");
+		http_response(req, HTTP_STATUS_METHOD_NOT_ALLOWED, NULL, 0);
+		return (KORE_RESULT_OK);
+	}
+
+	if (!filemap_resolve(hdlr, req->path, path, sizeof(path))) {
+		http_response(req, HTTP_STATUS_NOT_FOUND, NULL, 0);
+		return (KORE_RESULT_OK);
+	}
+
+	if ((fe = filemap_lookup(path)) == NULL || fe->fd == -1) {
+		http_response(req, HTTP_STATUS_NOT_FOUND, NULL, 0);
+		return (KORE_RESULT_OK);
+	}
+
+	type = fe->type;
+
+	/*
+	 * With compress set for the handler a gzip'd sibling (foo.css.gz)
+	 * is sent instead of the file itself to clients that accept it.
+	 * Range requests always get the file itself.
+	 */
+	if (hdlr->compress || hdlr->dom->compress) {
+		http_response_header(req, "vary", "accept-encoding");
+		if (!http_request_header_id(req, HTTP_HDR_RANGE, &hdr) &&
+		    http_compress_accepted(req) == HTTP_COMPRESS_GZIP &&
+		    (plen = strlen(path)) + 3 < sizeof(path)) {
+			memcpy(path + plen, ".gz", 4);
+			if ((gz = filemap_lookup(path)) != NULL &&
+			    gz->fd != -1) {
+				fe = gz;
+				http_response_header(req,
+				    "content-encoding", "gzip");
+			}
+		}
+	}
+
+	http_response_header(req, "etag", fe->etag);
+	http_response_header(req, "last-modified", fe->lastmod);
+
+	if (http_request_header_id(req, HTTP_HDR_IF_NONE_MATCH, &hdr)) {
+		if (http_etag_match(hdr, fe->etag)) {
+			http_response(req, HTTP_STATUS_NOT_MODIFIED, NULL, 0);
+			return (KORE_RESULT_OK);
+		}
+	} else if (http_request_header_id(req,
+	    HTTP_HDR_IF_MODIFIED_SINCE, &hdr)) {
+		if (!strcmp(hdr, fe->lastmod) ||
+		    fe->mtime <= kore_date_to_time(hdr)) {
+			http_response(req, HTTP_STATUS_NOT_MODIFIED, NULL, 0);
+			return (KORE_RESULT_OK);
+		}
+	}
+
+	off = 0;
+	len = fe->size;
+	status = HTTP_STATUS_OK;
+
+	if (http_request_header_id(req, HTTP_HDR_RANGE, &hdr) &&
+	    filemap_if_range(req, fe)) {
+		switch (filemap_range(hdr, fe->size, &off, &len)) {
+		case KORE_RESULT_OK:
+			(void)snprintf(path, sizeof(path),
+			    "bytes %jd-%jd/%jd", (intmax_t)off,
+			    (intmax_t)(off + len - 1), (intmax_t)fe->size);
+			http_response_header(req, "content-range", path);
+			status = HTTP_STATUS_PARTIAL_CONTENT;
+			break;
+		case KORE_RESULT_ERROR:
+			(void)snprintf(path, sizeof(path),
+			    "bytes */%jd", (intmax_t)fe->size);
+			http_response_header(req, "content-range", path);
+			http_response(req,
+			    HTTP_STATUS_REQUEST_RANGE_INVALID, NULL, 0);
+			return (KORE_RESULT_OK);
+		default:
+			break;
+		}
+	}
+
+	http_response_header(req, "content-type", type);
+	http_response_header(req, "accept-ranges", "bytes");
+
+	if (len == 0) {
+		http_response(req, status, NULL, 0);
+		return (KORE_RESULT_OK);
+	}
+
+	/* The netbuf closes its descriptor, the cached one stays open. */
+	if ((fd = dup(fe->fd)) == -1) {
+		kore_log(LOG_ERR, "dup(%s): %s", fe->path, errno_s);
+		http_response(req, HTTP_STATUS_INTERNAL_ERROR, NULL, 0);
+		return (KORE_RESULT_OK);
+	}
+
+	http_response_fd(req, status, fd, off, len);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+filemap_init(void)
+{
+	u_int32_t	i, n;
+
+	n = FILEMAP_BUCKETS_MIN;
+	while (n < kore_filemap_cache_max)
+		n <<= 1;
+
+	filemap_buckets = kore_calloc(n, sizeof(*filemap_buckets));
+	for (i = 0; i < n; i++)
+		LIST_INIT(&filemap_buckets[i]);
+
+	filemap_mask = n - 1;
+	TAILQ_INIT(&filemap_lru);
+}
+
+static u_int32_t
+filemap_hash(const char *path)
+{
+	u_int32_t	h;
+
+	h = 2166136261U;
+	while (*path != '\0') {
+		h ^= (u_int8_t)*path++;
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+static struct filemap_entry *
+filemap_lookup(const char *path)
+{
+	u_int32_t		h;
+	u_int64_t		now;
+	struct filemap_entry	*fe;
+
+	if (filemap_buckets == NULL)
+		filemap_init();
+
+	h = filemap_hash(path);
+	now = kore_time_mono_ms();
+
+	LIST_FOREACH(fe, &filemap_buckets[h & filemap_mask], hlist) {
+		if (fe->hash == h && !strcmp(fe->path, path))
+			break;
+	}
+
+	if (fe != NULL) {
+		if (now - fe->checked >= kore_filemap_cache_ttl)
+			filemap_revalidate(fe, now);
+		TAILQ_REMOVE(&filemap_lru, fe, lru);
+		TAILQ_INSERT_HEAD(&filemap_lru, fe, lru);
+		return (fe);
+	}
+
+	if (filemap_count >= kore_filemap_cache_max)
+		filemap_evict();
+
+	fe = kore_malloc(sizeof(*fe));
+	fe->fd = -1;
+	fe->hash = h;
+	fe->path = kore_strdup(path);
+	filemap_open(fe, now);
+
+	filemap_count++;
+	TAILQ_INSERT_HEAD(&filemap_lru, fe, lru);
+	LIST_INSERT_HEAD(&filemap_buckets[h & filemap_mask], fe, hlist);
+
+	return (fe);
+}
+
+static void
+filemap_open(struct filemap_entry *fe, u_int64_t now)
+{
+	struct stat	st;
+	struct tm	tm;
+
+	if (fe->fd != -1)
+		(void)close(fe->fd);
+
+	fe->checked = now;
+	fe->type = NULL;
+
+	if ((fe->fd = open(fe->path, O_RDONLY)) == -1)
+		return;
+
+	if (fstat(fe->fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		(void)close(fe->fd);
+		fe->fd = -1;
+		return;
+	}
+
+	fe->ino = st.st_ino;
+	fe->size = st.st_size;
+	fe->mtime = st.st_mtime;
+	fe->type = filemap_type(fe->path);
+
+	(void)snprintf(fe->etag, sizeof(fe->etag), "\"%jx-%jx-%jx\"",
+	    (uintmax_t)fe->ino, (uintmax_t)fe->mtime, (uintmax_t)fe->size);
+
+	if (gmtime_r(&fe->mtime, &tm) == NULL ||
+	    !strftime(fe->lastmod, sizeof(fe->lastmod),
+	    "%a, %d %b %Y %T GMT", &tm))
+		fe->lastmod[0] = '\0';
+}
+
+static void
+filemap_revalidate(struct filemap_entry *fe, u_int64_t now)
+{
+	struct stat	st;
+
+	if (stat(fe->path, &st) == -1 || !S_ISREG(st.st_mode)) {
+		if (fe->fd == -1) {
+			fe->checked = now;
+			return;
+		}
+	} else if (fe->fd != -1 && st.st_ino == fe->ino &&
+	    st.st_size == fe->size && st.st_mtime == fe->mtime) {
+		fe->checked = now;
+		return;
+	}
+
+	filemap_open(fe, now);
+}
+
+static void
+filemap_evict(void)
+{
+	struct filemap_entry	*fe;
+
+	if ((fe = TAILQ_LAST(&filemap_lru, filemap_lru_head)) == NULL)
+		return;
+
+	TAILQ_REMOVE(&filemap_lru, fe, lru);
+	LIST_REMOVE(fe, hlist);
+	filemap_count--;
+
+	if (fe->fd != -1)
+		(void)close(fe->fd);
+
+	kore_free(fe->path);
+	kore_free(fe);
+}
+
+static const char *
+filemap_type(const char *path)
+{
+	int		i;
+	const char	*ext;
+
+	if ((ext = strrchr(path, '.')) == NULL || strchr(ext, '/') != NULL)
+		return ("application/octet-stream");
+
+	for (i = 0, ext++; filemap_types[i].ext != NULL; i++) {
+		if (!strcasecmp(filemap_types[i].ext, ext))
+			return (filemap_types[i].type);
+	}
+
+	return ("application/octet-stream");
+}
+
+/*
+ * Map the request path onto the docroot, undoing percent-encoding and
+ * refusing anything that would climb out of it.
+ */
+static int
+filemap_resolve(struct kore_module_handle *hdlr, const char *rpath,
+    char *out, size_t outlen)
+{
+	size_t		len, i;
+	const char	*p;
+	char		*seg, hex[3];
+	int		err;
+
+	len = kore_strlcpy(out, hdlr->root, outlen);
+	if (len >= outlen)
+		return (KORE_RESULT_ERROR);
+
+	p = rpath + strlen(hdlr->path);
+	if (*p != '/')
+		out[len++] = '/';
+
+	for (i = len; *p != '\0'; p++) {
+		if (i >= outlen - 1)
+			return (KORE_RESULT_ERROR);
+
+		if (*p != '%') {
+			out[i++] = *p;
+			continue;
+		}
+
+		if (!isxdigit((unsigned char)p[1]) ||
+		    !isxdigit((unsigned char)p[2]))
+			return (KORE_RESULT_ERROR);
+
+		hex[0] = p[1];
+		hex[1] = p[2];
+		hex[2] = '\0';
+
+		out[i] = kore_strtonum(hex, 16, 1, 255, &err);
+		if (err != KORE_RESULT_OK)
+			return (KORE_RESULT_ERROR);
+
+		i++;
+		p += 2;
+	}
+
+	out[i] = '\0';
+
+	for (seg = out + len - 1; seg != NULL; seg = strchr(seg + 1, '/')) {
+		if (seg[1] == '.' && seg[2] == '.' &&
+		    (seg[3] == '/' || seg[3] == '\0'))
+			return (KORE_RESULT_ERROR);
+	}
+
+	if (out[i - 1] == '/') {
+		if (i + sizeof("index.html") > outlen)
+			return (KORE_RESULT_ERROR);
+		memcpy(out + i, "index.html", sizeof("index.html"));
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Parse a single "bytes=" range. Returns KORE_RESULT_OK with off and len
+ * set, KORE_RESULT_ERROR if the range cannot be satisfied and
+ * KORE_RESULT_RETRY if the header should be ignored (malformed, or more
+ * than one range, for which the whole file is sent instead).
+ */
+static int
+filemap_range(const char *hdr, off_t size, off_t *off, off_t *len)
+{
+	u_int64_t	first, last, max;
+	int		suffix, has_last;
+
+	if (strncasecmp(hdr, "bytes=", 6) || strchr(hdr, ',') != NULL)
+		return (KORE_RESULT_RETRY);
+
+	hdr += 6;
+	first = last = 0;
+	max = (u_int64_t)size;
+	suffix = (*hdr == '-');
+
+	if (!suffix) {
+		if (!isdigit((unsigned char)*hdr))
+			return (KORE_RESULT_RETRY);
+		if ((hdr = filemap_range_num(hdr, &first)) == NULL ||
+		    *hdr != '-')
+			return (KORE_RESULT_RETRY);
+	}
+
+	hdr++;
+	has_last = isdigit((unsigned char)*hdr);
+	if (has_last && (hdr = filemap_range_num(hdr, &last)) == NULL)
+		return (KORE_RESULT_RETRY);
+
+	if (*hdr != '\0' || (suffix && !has_last))
+		return (KORE_RESULT_RETRY);
+
+	if (suffix) {
+		if (last == 0 || max == 0)
+			return (KORE_RESULT_ERROR);
+		*len = MIN(last, max);
+		*off = size - *len;
+		return (KORE_RESULT_OK);
+	}
+
+	if (first >= max)
+		return (KORE_RESULT_ERROR);
+
+	if (!has_last || last >= max)
+		last = max - 1;
+	if (last < first)
+		return (KORE_RESULT_RETRY);
+
+	*off = first;
+	*len = last - first + 1;
+
+	return (KORE_RESULT_OK);
+}
+
+/* Parse digits into num, saturating instead of overflowing. */
+static const char *
+filemap_range_num(const char *p, u_int64_t *num)
+{
+	*num = 0;
+	for (; isdigit((unsigned char)*p); p++) {
+		if (*num > (UINT64_MAX - 9) / 10)
+			*num = UINT64_MAX;
+		else
+			*num = *num * 10 + (*p - '0');
+	}
+
+	return (p);
+}
+
+/*
+ * A range is only honored if an if-range validator, when present, still
+ * matches the file.
+ */
+static int
+filemap_if_range(struct http_request *req, struct filemap_entry *fe)
+{
+	char		*val;
+
+	if (!http_request_header(req, "if-range", &val))
+		return (1);
+
+	if (*val == '"')
+		return (!strcmp(val, fe->etag));
+
+	if (!strcmp(val, fe->lastmod))
+		return (1);
+
+	return (kore_date_to_time(val) == fe->mtime);
+}
@@ -26,6 +26,13 @@
 #include <stdio.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define ZLIB_CONST
+#include <zlib.h>
+
 #include "kore.h"
 #include "http.h"
 
@@ -41,10 +48,121 @@
 #include "tasks.h"
 #endif
 
+/*
+ * Index of a header block built by a single pass over it: for every
+ * line the offsets of its start, its first colon (0 if none) and its
+ * end (the CR or LF terminating it).
+ */
+struct http_scan_line {
+	u_int16_t		start;
+	u_int16_t		colon;
+	u_int16_t		end;
+};
+
+struct http_scan {
+	size_t			end;
+	size_t			start;
+	size_t			colon;
+	int			count;
+	struct http_scan_line	lines[HTTP_REQ_HEADER_MAX];
+};
+
+/*
+ * Well-known request headers live in req->hdr_values indexed by their
+ * HTTP_HDR_* id. The hash below is perfect for this set, http_init()
+ * verifies that.
+ */
+#define HTTP_HDR_HASH_SIZE	64
+#define HTTP_HDR_HASH(n, l)						\
+	(((l) * 5 + tolower(*(const unsigned char *)(n)) +		\
+	tolower(*((const unsigned char *)(n) + (l) - 1)) * 10) &	\
+	(HTTP_HDR_HASH_SIZE - 1))
+
+static const struct {
+	const char	*name;
+	size_t		len;
+} http_hdr_names[HTTP_HDR_MAX] = {
+	{ "accept", 6 },
+	{ "accept-encoding", 15 },
+	{ "accept-language", 15 },
+	{ "authorization", 13 },
+	{ "cache-control", 13 },
+	{ "connection", 10 },
+	{ "content-length", 14 },
+	{ "content-type", 12 },
+	{ "cookie", 6 },
+	{ "expect", 6 },
+	{ "host", 4 },
+	{ "if-modified-since", 17 },
+	{ "if-none-match", 13 },
+	{ "origin", 6 },
+	{ "range", 5 },
+	{ "referer", 7 },
+	{ "sec-websocket-key", 17 },
+	{ "sec-websocket-version", 21 },
+	{ "transfer-encoding", 17 },
+	{ "upgrade", 7 },
+	{ "user-agent", 10 },
+	{ "x-forwarded-for", 15 },
+};
+
+static int8_t	http_hdr_hash[HTTP_HDR_HASH_SIZE];
+
+/*
+ * Idle deflate streams are kept per content-coding and reset for the
+ * next response instead of paying for deflateInit2() every time.
+ */
+#define HTTP_DEFLATE_IDLE_MAX	8
+
+struct http_deflate {
+	z_stream			strm;
+	int				type;
+	LIST_ENTRY(http_deflate)	list;
+};
+
+static const char	*http_compress_names[] = { NULL, "gzip", "deflate" };
+
+static LIST_HEAD(, http_deflate)	http_deflate_idle[2];
+static u_int32_t			http_deflate_idle_count;
+static u_int8_t				*http_deflate_buf;
+static size_t				http_deflate_buf_len;
+
+/* States of the chunked request body decoder (req->chunk_state). */
+#define HTTP_CHUNK_SIZE		1
+#define HTTP_CHUNK_DATA		2
+#define HTTP_CHUNK_DATA_END	3
+#define HTTP_CHUNK_TRAILER	4
+#define HTTP_CHUNK_DONE		5
+
 static int	http_body_recv(struct netbuf *);
+static int	http_body_chunk_recv(struct netbuf *);
+static ssize_t	http_body_chunked(struct http_request *,
+		    const u_int8_t *, size_t, int *);
+static int	http_body_offload(struct http_request *);
+static int	http_body_write(struct http_request *, const void *, size_t);
+static void	http_pipeline_next(struct connection *);
+static int	http_response_chunk_drained(struct netbuf *);
+static void	http_response_chunk_queue(struct connection *,
+		    const void *, size_t);
+static int	http_response_chunk_deflate(struct http_request *,
+		    const void *, size_t, int);
+static void	http_response_compress(struct http_request *, int,
+		    const void **, size_t *);
+static int	http_compress_negotiate(struct http_request *, int);
+static int	http_compress(int, const void *, size_t,
+		    const u_int8_t **, size_t *);
+static struct http_deflate	*http_deflate_get(int);
+static void	http_deflate_put(struct http_deflate *);
+static void	http_deflate_reserve(size_t);
+static int	http_header_id(const char *, size_t);
+static int	http_request_line(char *, char **);
+static int	http_scan(struct http_scan *, const u_int8_t *, size_t);
+static inline int	http_scan_byte(struct http_scan *,
+			    const u_int8_t *, size_t);
 static void	http_error_response(struct connection *, int);
 static void	http_write_response_cookie(struct http_cookie *);
 static void	http_argument_add(struct http_request *, char *, char *);
+static void	http_request_arena_free(struct http_request *);
 static void	http_response_normal(struct http_request *,
 		    struct connection *, int, const void *, size_t);
 static void	multipart_add_field(struct http_request *, struct kore_buf *,
@@ -61,17 +179,28 @@ static struct kore_buf			*header_buf;
 static struct kore_buf			*ckhdr_buf;
 static char				http_version[32];
 static u_int16_t			http_version_len;
-static TAILQ_HEAD(, http_request)	http_requests;
+static int				http_requests_left;
+static TAILQ_HEAD(http_request_list, http_request)	http_requests;
 static TAILQ_HEAD(, http_request)	http_requests_sleeping;
 static struct kore_pool			http_request_pool;
-static struct kore_pool			http_header_pool;
-static struct kore_pool			http_cookie_pool;
-static struct kore_pool			http_host_pool;
-static struct kore_pool			http_path_pool;
+static struct kore_pool			http_arena_pool;
 static struct kore_pool			http_body_path;
 
 int		http_request_count = 0;
 u_int32_t	http_request_limit = HTTP_REQUEST_LIMIT;
+u_int32_t	http_request_budget = HTTP_REQUEST_BUDGET;
+u_int32_t	http_request_arena = HTTP_REQUEST_ARENA;
+u_int32_t	http_send_highwater = HTTP_SEND_HIGHWATER;
+u_int32_t	http_compress_min = HTTP_COMPRESS_MIN;
+int		http_compress_level = HTTP_COMPRESS_LEVEL;
+char		*http_compress_types[HTTP_COMPRESS_TYPES_MAX + 1] = {
+	"text/",
+	"application/json",
+	"application/javascript",
+	"application/xml",
+	"image/svg+xml",
+	NULL
+};
 u_int64_t	http_hsts_enable = HTTP_HSTS_ENABLE;
 u_int16_t	http_header_max = HTTP_HEADER_MAX_LEN;
 u_int16_t	http_keepalive_time = HTTP_KEEPALIVE_TIME;
@@ -83,13 +212,19 @@ void
 http_init(void)
 {
 	int		prealloc, l;
+	size_t		h;
 
+	http_requests_left = 0;
 	TAILQ_INIT(&http_requests);
 	TAILQ_INIT(&http_requests_sleeping);
 
 	header_buf = kore_buf_alloc(HTTP_HEADER_BUFSIZE);
 	ckhdr_buf = kore_buf_alloc(HTTP_COOKIE_BUFSIZE);
 
+	LIST_INIT(&http_deflate_idle[0]);
+	LIST_INIT(&http_deflate_idle[1]);
+	http_deflate_idle_count = 0;
+
 	l = snprintf(http_version, sizeof(http_version),
 	    "server: kore (%d.%d.%d-%s)\r\n", KORE_VERSION_MAJOR,
 	    KORE_VERSION_MINOR, KORE_VERSION_PATCH, KORE_VERSION_STATE);
@@ -98,18 +233,22 @@ http_init(void)
 
 	http_version_len = l;
 
+	memset(http_hdr_hash, -1, sizeof(http_hdr_hash));
+	for (l = 0; l < HTTP_HDR_MAX; l++) {
+		h = HTTP_HDR_HASH(http_hdr_names[l].name,
+		    http_hdr_names[l].len);
+		if (http_hdr_hash[h] != -1)
+			fatal("http_init(): collision for %s",
+			    http_hdr_names[l].name);
+		http_hdr_hash[h] = l;
+	}
+
 	prealloc = MIN((worker_max_connections / 10), 1000);
 	kore_pool_init(&http_request_pool, "http_request_pool",
 	    sizeof(struct http_request), prealloc);
-	kore_pool_init(&http_header_pool, "http_header_pool",
-	    sizeof(struct http_header), prealloc * HTTP_REQ_HEADER_MAX);
-	kore_pool_init(&http_cookie_pool, "http_cookie_pool",
-		sizeof(struct http_cookie), prealloc * HTTP_MAX_COOKIES);
-
-	kore_pool_init(&http_host_pool,
-	    "http_host_pool", KORE_DOMAINNAME_LEN, prealloc);
-	kore_pool_init(&http_path_pool,
-	    "http_path_pool", HTTP_URI_LEN, prealloc);
+	kore_pool_init(&http_arena_pool, "http_arena_pool",
+	    http_request_arena, prealloc);
+
 	kore_pool_init(&http_body_path,
 	    "http_body_path", HTTP_BODY_PATH_MAX, prealloc);
 }
@@ -117,6 +256,9 @@ http_init(void)
 void
 http_cleanup(void)
 {
+	int			i;
+	struct http_deflate	*dfl;
+
 	if (header_buf != NULL) {
 		kore_buf_free(header_buf);
 		header_buf = NULL;
@@ -127,10 +269,21 @@ http_cleanup(void)
 		ckhdr_buf = NULL;
 	}
 
+	for (i = 0; i < 2; i++) {
+		while ((dfl = LIST_FIRST(&http_deflate_idle[i])) != NULL) {
+			LIST_REMOVE(dfl, list);
+			(void)deflateEnd(&dfl->strm);
+			kore_free(dfl);
+		}
+	}
+	http_deflate_idle_count = 0;
+
+	kore_free(http_deflate_buf);
+	http_deflate_buf = NULL;
+	http_deflate_buf_len = 0;
+
 	kore_pool_cleanup(&http_request_pool);
-	kore_pool_cleanup(&http_header_pool);
-	kore_pool_cleanup(&http_host_pool);
-	kore_pool_cleanup(&http_path_pool);
+	kore_pool_cleanup(&http_arena_pool);
 	kore_pool_cleanup(&http_body_path);
 }
 
@@ -148,25 +301,24 @@ http_server_version(const char *version)
 }
 
 int
-http_request_new(struct connection *c, const char *host,
-    const char *method, const char *path, const char *version,
+http_request_new(struct connection *c, char *host,
+    const char *method, char *path, const char *version,
     struct http_request **out)
 {
 	struct http_request		*req;
 	struct kore_module_handle	*hdlr;
 	char				*p, *hp;
 	int				m, flags;
-	size_t				hostlen, pathlen, qsoff;
 
 	kore_debug("http_request_new(%p, %s, %s, %s, %s)", c, host,
 	    method, path, version);
 
-	if ((hostlen = strlen(host)) >= KORE_DOMAINNAME_LEN - 1) {
+	if (strlen(host) >= KORE_DOMAINNAME_LEN - 1) {
 		http_error_response(c, 400);
 		return (KORE_RESULT_ERROR);
 	}
 
-	if ((pathlen = strlen(path)) >= HTTP_URI_LEN - 1) {
+	if (strlen(path) >= HTTP_URI_LEN - 1) {
 		http_error_response(c, 414);
 		return (KORE_RESULT_ERROR);
 	}
@@ -176,12 +328,8 @@ http_request_new(struct connection *c, const char *host,
 		return (KORE_RESULT_ERROR);
 	}
 
-	if ((p = strchr(path, '?')) != NULL) {
+	if ((p = strchr(path, '?')) != NULL)
 		*p = '\0';
-		qsoff = p - path;
-	} else {
-		qsoff = 0;
-	}
 
 	hp = NULL;
 
@@ -213,9 +361,6 @@ http_request_new(struct connection *c, const char *host,
 	if (hp != NULL)
 		*hp = ':';
 
-	if (p != NULL)
-		*p = '?';
-
 	if (!strcasecmp(method, "get")) {
 		m = HTTP_METHOD_GET;
 		flags = HTTP_REQUEST_COMPLETE;
@@ -243,6 +388,9 @@ http_request_new(struct connection *c, const char *host,
 	req->end = 0;
 	req->total = 0;
 	req->start = 0;
+	req->end_us = 0;
+	req->total_us = 0;
+	req->start_us = 0;
 	req->owner = c;
 	req->status = 0;
 	req->method = m;
@@ -250,6 +398,7 @@ http_request_new(struct connection *c, const char *host,
 	req->agent = NULL;
 	req->flags = flags;
 	req->fsm_state = 0;
+	req->chunk_state = 0;
 	req->http_body = NULL;
 	req->http_body_fd = -1;
 	req->hdlr_extra = NULL;
@@ -257,25 +406,23 @@ http_request_new(struct connection *c, const char *host,
 	req->http_body_length = 0;
 	req->http_body_offset = 0;
 	req->http_body_path = NULL;
+	req->deflate = NULL;
 
 #if defined(KORE_USE_PYTHON)
 	req->py_coro = NULL;
 #endif
 
-	req->host = kore_pool_get(&http_host_pool);
-	memcpy(req->host, host, hostlen);
-	req->host[hostlen] = '\0';
+	req->host = host;
+	req->path = path;
+	req->route_nparams = 0;
+	req->arena = NULL;
+	req->headers = NULL;
+	memset(req->hdr_values, 0, sizeof(req->hdr_values));
 
-	req->path = kore_pool_get(&http_path_pool);
-	memcpy(req->path, path, pathlen);
-	req->path[pathlen] = '\0';
-
-	if (qsoff > 0) {
-		req->query_string = req->path + qsoff;
-		*(req->query_string)++ = '\0';
-	} else {
+	if (p != NULL)
+		req->query_string = p + 1;
+	else
 		req->query_string = NULL;
-	}
 
 	TAILQ_INIT(&(req->resp_headers));
 	TAILQ_INIT(&(req->req_headers));
@@ -293,7 +440,7 @@ http_request_new(struct connection *c, const char *host,
 #endif
 
 	http_request_count++;
-	TAILQ_INSERT_HEAD(&http_requests, req, list);
+	TAILQ_INSERT_TAIL(&http_requests, req, list);
 	TAILQ_INSERT_TAIL(&(c->http_requests), req, olist);
 
 	if (out != NULL)
@@ -326,35 +473,75 @@ http_request_wakeup(struct http_request *req)
 	}
 }
 
+/*
+ * Run the requests on the ready queue in order. Each request is moved to
+ * the back before it runs so that requests that retry take turns with the
+ * others. Processing stops at the time budget or the request limit, and
+ * carries on in the next loop iteration.
+ */
 void
 http_process(void)
 {
-	u_int32_t			count;
-	struct http_request		*req, *next;
+	u_int32_t			count, queued;
+	u_int64_t			start, budget;
+	struct http_request		*req;
+
+	/*
+	 * Visit at most the requests queued right now. Handlers can put
+	 * other requests to sleep or free them, so none of them can be
+	 * relied on to mark the end of the pass.
+	 */
+	queued = 0;
+	TAILQ_FOREACH(req, &http_requests, list)
+		queued++;
+
+	http_requests_left = 0;
+	if (queued == 0)
+		return;
 
 	count = 0;
-	for (req = TAILQ_FIRST(&http_requests); req != NULL; req = next) {
-		if (count >= http_request_limit)
+	start = kore_time_mono_us();
+	budget = (u_int64_t)http_request_budget * 1000;
+
+	while (queued-- > 0) {
+		if ((req = TAILQ_FIRST(&http_requests)) == NULL)
 			break;
 
-		next = TAILQ_NEXT(req, list);
-		if (req->flags & HTTP_REQUEST_DELETE) {
-			http_request_free(req);
-			continue;
-		}
+		TAILQ_REMOVE(&http_requests, req, list);
+		TAILQ_INSERT_TAIL(&http_requests, req, list);
 
 		/* Sleeping requests should be in http_requests_sleeping. */
 		if (req->flags & HTTP_REQUEST_SLEEPING)
 			fatal("http_process: sleeping request on list");
 
-		if (!(req->flags & HTTP_REQUEST_COMPLETE))
-			continue;
+		if (!(req->flags & HTTP_REQUEST_DELETE) &&
+		    (req->flags & HTTP_REQUEST_COMPLETE)) {
+			count++;
+			http_process_request(req);
+		}
 
-		count++;
-		http_process_request(req);
+		if ((req->flags & HTTP_REQUEST_DELETE) &&
+		    !(req->flags & HTTP_REQUEST_SLEEPING))
+			http_request_free(req);
+
+		if (queued == 0 || TAILQ_EMPTY(&http_requests))
+			break;
+
+		if (count >= http_request_limit ||
+		    (kore_time_mono_us() - start) >= budget) {
+			http_requests_left = 1;
+			break;
+		}
 	}
 }
 
+/* Did the last http_process() leave requests behind due to its budget? */
+int
+http_process_ready(void)
+{
+	return (http_requests_left);
+}
+
 void
 http_process_request(struct http_request *req)
 {
@@ -367,6 +554,7 @@ http_process_request(struct http_request *req)
 		return;
 
 	req->start = kore_time_ms();
+	req->start_us = kore_time_mono_us();
 	if (req->hdlr->auth != NULL && !(req->flags & HTTP_REQUEST_AUTHED))
 		r = kore_auth_run(req, req->hdlr->auth);
 	else
@@ -374,7 +562,10 @@ http_process_request(struct http_request *req)
 
 	switch (r) {
 	case KORE_RESULT_OK:
-		r = kore_runtime_http_request(req->hdlr->rcall, req);
+		if (req->hdlr->type == HANDLER_TYPE_FILEMAP)
+			r = kore_filemap_serve(req);
+		else
+			r = kore_runtime_http_request(req->hdlr->rcall, req);
 		break;
 	case KORE_RESULT_RETRY:
 		break;
@@ -388,8 +579,11 @@ http_process_request(struct http_request *req)
 	default:
 		fatal("kore_auth() returned unknown %d", r);
 	}
-	req->end = kore_time_ms();
-	req->total += req->end - req->start;
+	/* Wall clock ms for modules, the precise duration in the _us fields. */
+	req->end_us = kore_time_mono_us();
+	req->total_us += req->end_us - req->start_us;
+	req->end = req->start + (req->end_us - req->start_us) / 1000;
+	req->total = req->total_us / 1000;
 
 	switch (r) {
 	case KORE_RESULT_OK:
@@ -420,12 +614,71 @@ http_response_header(struct http_request *req,
 
 	kore_debug("http_response_header(%p, %s, %s)", req, header, value);
 
-	hdr = kore_pool_get(&http_header_pool);
-	hdr->header = kore_strdup(header);
-	hdr->value = kore_strdup(value);
+	hdr = http_request_arena_alloc(req, sizeof(*hdr));
+	hdr->header = http_request_arena_strdup(req, header);
+	hdr->value = http_request_arena_strdup(req, value);
 	TAILQ_INSERT_TAIL(&(req->resp_headers), hdr, list);
 }
 
+void *
+http_request_arena_alloc(struct http_request *req, size_t len)
+{
+	void			*ptr;
+	size_t			avail;
+	struct http_arena	*arena;
+
+	avail = http_request_arena - sizeof(*arena);
+	len = (len + HTTP_ARENA_ALIGN - 1) & ~(HTTP_ARENA_ALIGN - 1);
+
+	/*
+	 * Anything that does not fit in a regular chunk gets a chunk
+	 * of its own, linked in behind the current one so the space
+	 * left in that one can still be handed out.
+	 */
+	if (len > avail) {
+		arena = kore_malloc(sizeof(*arena) + len);
+		arena->len = len;
+		arena->offset = len;
+
+		if (req->arena != NULL) {
+			arena->next = req->arena->next;
+			req->arena->next = arena;
+		} else {
+			arena->next = NULL;
+			req->arena = arena;
+		}
+
+		return (arena + 1);
+	}
+
+	arena = req->arena;
+	if (arena == NULL || arena->len - arena->offset < len) {
+		arena = kore_pool_get(&http_arena_pool);
+		arena->len = avail;
+		arena->offset = 0;
+		arena->next = req->arena;
+		req->arena = arena;
+	}
+
+	ptr = (u_int8_t *)(arena + 1) + arena->offset;
+	arena->offset += len;
+
+	return (ptr);
+}
+
+char *
+http_request_arena_strdup(struct http_request *req, const char *str)
+{
+	size_t		len;
+	char		*nstr;
+
+	len = strlen(str) + 1;
+	nstr = http_request_arena_alloc(req, len);
+	(void)memcpy(nstr, str, len);
+
+	return (nstr);
+}
+
 void
 http_request_free(struct http_request *req)
 {
@@ -436,10 +689,7 @@ http_request_free(struct http_request *req)
 #if defined(KORE_USE_PGSQL)
 	struct kore_pgsql	*pgsql;
 #endif
-	struct http_file	*f, *fnext;
-	struct http_arg		*q, *qnext;
-	struct http_header	*hdr, *next;
-	struct http_cookie	*ck, *cknext;
+	struct connection	*c;
 
 #if defined(KORE_USE_TASKS)
 	pending_tasks = 0;
@@ -470,71 +720,18 @@ http_request_free(struct http_request *req)
 
 	kore_debug("http_request_free: %p->%p", req->owner, req);
 
-	kore_pool_put(&http_host_pool, req->host);
-	kore_pool_put(&http_path_pool, req->path);
+	kore_free(req->headers);
 
 	req->host = NULL;
 	req->path = NULL;
+	req->headers = NULL;
 
 	TAILQ_REMOVE(&http_requests, req, list);
 	if (req->owner != NULL)
 		TAILQ_REMOVE(&(req->owner->http_requests), req, olist);
+	c = req->owner;
 
-	for (hdr = TAILQ_FIRST(&(req->resp_headers)); hdr != NULL; hdr = next) {
-		next = TAILQ_NEXT(hdr, list);
-
-		TAILQ_REMOVE(&(req->resp_headers), hdr, list);
-		kore_free(hdr->header);
-		kore_free(hdr->value);
-		kore_pool_put(&http_header_pool, hdr);
-	}
-
-	for (hdr = TAILQ_FIRST(&(req->req_headers)); hdr != NULL; hdr = next) {
-		next = TAILQ_NEXT(hdr, list);
-
-		TAILQ_REMOVE(&(req->req_headers), hdr, list);
-		kore_free(hdr->header);
-		kore_free(hdr->value);
-		kore_pool_put(&http_header_pool, hdr);
-	}
-
-	for (ck = TAILQ_FIRST(&(req->resp_cookies)); ck != NULL; ck = cknext) {
-		cknext = TAILQ_NEXT(ck, list);
-
-		TAILQ_REMOVE(&(req->resp_cookies), ck, list);
-		kore_free(ck->name);
-		kore_free(ck->value);
-		kore_free(ck->path);
-		kore_free(ck->domain);
-		kore_pool_put(&http_cookie_pool, ck);
-	}
-
-	for (ck = TAILQ_FIRST(&(req->req_cookies)); ck != NULL; ck = cknext) {
-		cknext = TAILQ_NEXT(ck, list);
-
-		TAILQ_REMOVE(&(req->req_cookies), ck, list);
-		kore_free(ck->name);
-		kore_free(ck->value);
-		kore_pool_put(&http_cookie_pool, ck);
-	}
-
-	for (q = TAILQ_FIRST(&(req->arguments)); q != NULL; q = qnext) {
-		qnext = TAILQ_NEXT(q, list);
-
-		TAILQ_REMOVE(&(req->arguments), q, list);
-		kore_free(q->name);
-		kore_free(q->s_value);
-		kore_free(q);
-	}
-
-	for (f = TAILQ_FIRST(&(req->files)); f != NULL; f = fnext) {
-		fnext = TAILQ_NEXT(f, list);
-		TAILQ_REMOVE(&(req->files), f, list);
-
-		kore_free(f->filename);
-		kore_free(f->name);
-		kore_free(f);
-	}
+	http_request_arena_free(req);
 
 	if (req->http_body != NULL)
 		kore_buf_free(req->http_body);
@@ -554,15 +751,46 @@ http_request_free(struct http_request *req)
 	    !(req->flags & HTTP_REQUEST_RETAIN_EXTRA))
 		kore_free(req->hdlr_extra);
 
+	if (req->deflate != NULL)
+		http_deflate_put(req->deflate);
+
 	kore_pool_put(&http_request_pool, req);
 	http_request_count--;
+
+	if (c != NULL && TAILQ_EMPTY(&(c->http_requests)))
+		http_pipeline_next(c);
 }
 
 void
 http_serveable(struct http_request *req, const void *data, size_t len,
     const char *etag, const char *type)
 {
-	char		*match;
+	struct http_asset	asset;
+
+	memset(&asset, 0, sizeof(asset));
+	asset.data = data;
+	asset.len = len;
+	asset.etag = etag;
+	asset.type = type;
+
+	http_serve_asset(req, &asset);
+}
+
+/*
+ * Serve a builtin asset, picking the precompressed gzip variant if the
+ * client takes it. Each variant carries its own strong etag so that a
+ * matching if-none-match is answered before any body is considered.
+ * The variants go out as is, compressing them at runtime would send a
+ * different representation under the same etag.
+ */
+void
+http_serve_asset(struct http_request *req, const struct http_asset *asset)
+{
+	size_t			len;
+	const void		*data;
+	const char		*etag;
+	char			*match;
+	int			encoded;
 
 	if (req->method != HTTP_METHOD_GET) {
 		http_response_header(req, "allow", "get");
@@ -570,16 +798,42 @@ http_serveable(struct http_request *req, const void *data, size_t len,
 		return;
 	}
 
-	if (http_request_header(req, "if-none-match", &match)) {
-		if (!strcmp(match, etag)) {
+	encoded = 0;
+	if (asset->gzip != NULL && asset->gzip_len > 0) {
+		http_response_header(req, "vary", "accept-encoding");
+		if (http_compress_accepted(req) == HTTP_COMPRESS_GZIP)
+			encoded = 1;
+	}
+
+	if (encoded) {
+		data = asset->gzip;
+		len = asset->gzip_len;
+		etag = asset->gzip_etag;
+	} else {
+		data = asset->data;
+		len = asset->len;
+		etag = asset->etag;
+	}
+
+	http_response_header(req, "etag", etag);
+
+	if (http_request_header_id(req, HTTP_HDR_IF_NONE_MATCH, &match)) {
+		if (http_etag_match(match, etag)) {
 			http_response(req, HTTP_STATUS_NOT_MODIFIED, NULL, 0);
 			return;
 		}
 	}
 
-	http_response_header(req, "etag", etag);
-	http_response_header(req, "content-type", type);
-	http_response(req, HTTP_STATUS_OK, data, len);
+	if (encoded)
+		http_response_header(req, "content-encoding", "gzip");
+
+	http_response_header(req, "content-type", asset->type);
+
+	if (req->owner == NULL)
+		return;
+
+	req->status = HTTP_STATUS_OK;
+	http_response_normal(req, req->owner, HTTP_STATUS_OK, data, len);
 }
 
 void
@@ -595,6 +849,8 @@ http_response(struct http_request *req, int status, const void *d, size_t l)
 	switch (req->owner->proto) {
 	case CONN_PROTO_HTTP:
 	case CONN_PROTO_WEBSOCKET:
+		if (d != NULL)
+			http_response_compress(req, status, &d, &l);
 		http_response_normal(req, req->owner, status, d, l);
 		break;
 	default:
@@ -608,6 +864,7 @@ http_response_stream(struct http_request *req, int status, void *base,
     size_t len, int (*cb)(struct netbuf *), void *arg)
 {
 	struct netbuf		*nb;
+	const void		*d;
 
 	if (req->owner == NULL)
 		return;
@@ -616,6 +873,8 @@ http_response_stream(struct http_request *req, int status, void *base,
 
 	switch (req->owner->proto) {
 	case CONN_PROTO_HTTP:
+		d = base;
+		http_response_compress(req, status, &d, &len);
 		http_response_normal(req, req->owner, status, NULL, len);
 		break;
 	default:
@@ -623,17 +882,217 @@ http_response_stream(struct http_request *req, int status, void *base,
 		/* NOTREACHED. */
 	}
 
+	if (req->method == HTTP_METHOD_HEAD)
+		return;
+
+	/*
+	 * A compressed body is copied out, an empty stream behind it
+	 * still tells the caller when it has been sent.
+	 */
+	if (d != base) {
+		net_send_queue(req->owner, d, len);
+		base = NULL;
+		len = 0;
+	}
+
+	net_send_stream(req->owner, base, len, cb, &nb);
+	nb->extra = arg;
+}
+
+void
+http_response_fd(struct http_request *req, int status, int fd, off_t off,
+    size_t len)
+{
+	if (req->owner == NULL) {
+		(void)close(fd);
+		return;
+	}
+
+	req->status = status;
+
+	switch (req->owner->proto) {
+	case CONN_PROTO_HTTP:
+		http_response_normal(req, req->owner, status, NULL, len);
+		break;
+	default:
+		fatal("http_response_fd() bad proto %d", req->owner->proto);
+		/* NOTREACHED. */
+	}
+
+	if (req->method != HTTP_METHOD_HEAD)
+		net_send_file(req->owner, fd, off, len, NULL, NULL);
+	else
+		(void)close(fd);
+}
+
+/*
+ * Start a response of unknown length. The body follows as chunks via
+ * http_response_chunk() and is terminated by http_response_chunked_end().
+ */
+void
+http_response_chunked_begin(struct http_request *req, int status)
+{
+	int			type;
+	struct connection	*c = req->owner;
+
+	if (c == NULL)
+		return;
+
+	req->status = status;
+	req->flags |= HTTP_REQUEST_CHUNKED | HTTP_REQUEST_NO_CONTENT_LENGTH;
+
+	switch (c->proto) {
+	case CONN_PROTO_HTTP:
+		if ((type = http_compress_negotiate(req, status)) != 0 &&
+		    (req->deflate = http_deflate_get(type)) != NULL) {
+			http_response_header(req, "content-encoding",
+			    http_compress_names[type]);
+		}
+		http_response_header(req, "transfer-encoding", "chunked");
+		http_response_normal(req, c, status, NULL, 0);
+		break;
+	default:
+		fatal("http_response_chunked_begin() bad proto %d", c->proto);
+		/* NOTREACHED. */
+	}
+
+	/*
+	 * Chunks are flushed as they are queued, an empty send queue must
+	 * not close the connection before the last one went out.
+	 */
+	if (c->flags & CONN_CLOSE_EMPTY) {
+		c->flags &= ~CONN_CLOSE_EMPTY;
+		req->flags |= HTTP_REQUEST_CHUNKED_CLOSE;
+	}
+}
+
+/*
+ * Queue a chunk and try to send it right away. Returns KORE_RESULT_RETRY
+ * if more than http_send_highwater bytes are still waiting to go out, the
+ * request then sleeps until they have been sent and the handler should
+ * return KORE_RESULT_RETRY. Returns KORE_RESULT_ERROR if the connection
+ * is gone.
+ */
+int
+http_response_chunk(struct http_request *req, const void *data, size_t len)
+{
+	struct netbuf		*nb;
+	size_t			pending;
+	struct connection	*c = req->owner;
+
+	if (c == NULL || c->state != CONN_STATE_ESTABLISHED)
+		return (KORE_RESULT_ERROR);
+
+	if (!(req->flags & HTTP_REQUEST_CHUNKED))
+		fatal("http_response_chunk() without chunked response");
+
+	if (len > 0 && req->method != HTTP_METHOD_HEAD) {
+		if (req->deflate == NULL) {
+			http_response_chunk_queue(c, data, len);
+		} else if (!http_response_chunk_deflate(req,
+		    data, len, Z_SYNC_FLUSH)) {
+			kore_connection_disconnect(c);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	if (!net_send_flush(c)) {
+		kore_connection_disconnect(c);
+		return (KORE_RESULT_ERROR);
+	}
+
+	pending = 0;
+	TAILQ_FOREACH(nb, &(c->send_queue), list)
+		pending += nb->b_len - nb->s_off;
+
+	if (pending <= http_send_highwater)
+		return (KORE_RESULT_OK);
+
+	/* Wake up once everything queued so far has been sent. */
+	if (!(req->flags & HTTP_REQUEST_SLEEPING)) {
+		net_send_stream(c, NULL, 0, http_response_chunk_drained, &nb);
+		nb->extra = req;
+		http_request_sleep(req);
+	}
+
+	return (KORE_RESULT_RETRY);
+}
+
+void
+http_response_chunked_end(struct http_request *req)
+{
+	struct connection	*c = req->owner;
+
+	if (c == NULL || !(req->flags & HTTP_REQUEST_CHUNKED))
+		return;
+
 	if (req->method != HTTP_METHOD_HEAD) {
-		net_send_stream(req->owner, base, len, cb, &nb);
-		nb->extra = arg;
+		if (req->deflate != NULL &&
+		    !http_response_chunk_deflate(req, NULL, 0, Z_FINISH)) {
+			kore_connection_disconnect(c);
+			return;
+		}
+		net_send_queue(c, "0\r\n\r\n", 5);
+	}
+
+	if (req->deflate != NULL) {
+		http_deflate_put(req->deflate);
+		req->deflate = NULL;
+	}
+
+	req->flags &= ~HTTP_REQUEST_CHUNKED;
+	if (req->flags & HTTP_REQUEST_CHUNKED_CLOSE)
+		c->flags |= CONN_CLOSE_EMPTY;
+}
+
+/*
+ * Returns capture group idx of the dynamic handler regex, 0 being the
+ * whole match. The result points into the path and is not NUL-terminated,
+ * its length is stored in len.
+ *
+ * The router only tests if a regex matches, recording submatches is far
+ * more expensive. So the groups are extracted once, on the first call.
+ */
+int
+http_route_param(struct http_request *req, u_int8_t idx,
+    const char **out, size_t *len)
+{
+	size_t				n;
+	regmatch_t			*pm;
+	struct kore_module_handle	*hdlr = req->hdlr;
+
+	if (!(req->flags & HTTP_REQUEST_ROUTE_PARAMS)) {
+		req->flags |= HTTP_REQUEST_ROUTE_PARAMS;
+		if (hdlr->type == HANDLER_TYPE_DYNAMIC) {
+			n = MIN(hdlr->rctx.re_nsub + 1, HTTP_ROUTE_PARAMS_MAX);
+			if (!regexec(&(hdlr->rctx), req->path,
+			    n, req->route_params, 0))
+				req->route_nparams = n;
+		}
 	}
+
+	if (idx >= req->route_nparams)
+		return (KORE_RESULT_ERROR);
+
+	pm = &req->route_params[idx];
+	if (pm->rm_so == -1)
+		return (KORE_RESULT_ERROR);
+
+	*out = req->path + pm->rm_so;
+	*len = pm->rm_eo - pm->rm_so;
+
+	return (KORE_RESULT_OK);
 }
 
 int
 http_request_header(struct http_request *req, const char *header, char **out)
 {
+	int			id;
 	struct http_header	*hdr;
 
+	if ((id = http_header_id(header, strlen(header))) != -1)
+		return (http_request_header_id(req, id, out));
+
 	TAILQ_FOREACH(hdr, &(req->req_headers), list) {
 		if (!strcasecmp(hdr->header, header)) {
 			*out = hdr->value;
@@ -641,12 +1100,25 @@ http_request_header(struct http_request *req, const char *header, char **out)
 		}
 	}
 
-	if (!strcasecmp(header, "host")) {
+	return (KORE_RESULT_ERROR);
+}
+
+int
+http_request_header_id(struct http_request *req, int id, char **out)
+{
+	if (id < 0 || id >= HTTP_HDR_MAX)
+		return (KORE_RESULT_ERROR);
+
+	if (id == HTTP_HDR_HOST) {
 		*out = req->host;
 		return (KORE_RESULT_OK);
 	}
 
-	return (KORE_RESULT_ERROR);
+	if (req->hdr_values[id] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	*out = req->hdr_values[id];
+	return (KORE_RESULT_OK);
 }
 
 int
@@ -667,15 +1139,15 @@ http_request_cookie(struct http_request *req, const char *cookie, char **out)
 int
 http_header_recv(struct netbuf *nb)
 {
-	size_t			len;
-	ssize_t			ret;
+	size_t			len, body;
+	struct http_scan	scan;
 	struct http_header	*hdr;
 	struct http_request	*req;
 	u_int64_t		bytes_left;
 	u_int8_t		*end_headers;
-	int			h, i, v, skip, l;
-	char			*request[4], *host, *hbuf;
-	char			*p, *headers[HTTP_REQ_HEADER_MAX];
+	struct http_scan_line	*line;
+	int			i, v, skip, id;
+	char			*request[3], *host, *hbuf, *p;
 	struct connection	*c = (struct connection *)nb->owner;
 
 	kore_debug("http_header_recv(%p)", nb);
@@ -683,51 +1155,61 @@ http_header_recv(struct netbuf *nb)
 	if (nb->b_len < 4)
 		return (KORE_RESULT_OK);
 
-	skip = 4;
-	end_headers = kore_mem_find(nb->buf, nb->s_off, "\r\n\r\n", 4);
-	if (end_headers == NULL) {
-		end_headers = kore_mem_find(nb->buf, nb->s_off, "\n\n", 2);
-		if (end_headers == NULL)
-			return (KORE_RESULT_OK);
-		skip = 2;
+	/*
+	 * Pipelined requests are parsed one at a time, once the one before
+	 * them is gone, so responses go out in order. If the buffer fills
+	 * up in the meantime stop reading until http_pipeline_next().
+	 */
+	if (!TAILQ_EMPTY(&(c->http_requests))) {
+		if (nb->s_off == nb->b_len) {
+			c->flags |= CONN_READ_BLOCK;
+			c->flags &= ~CONN_READ_POSSIBLE;
+		}
+		return (KORE_RESULT_OK);
 	}
 
-	*end_headers = '\0';
-	end_headers += skip;
-	len = end_headers - nb->buf;
+	scan.count = 0;
+	scan.start = 0;
+	scan.colon = 0;
+
+	if (!http_scan(&scan, nb->buf, nb->s_off))
+		return (KORE_RESULT_OK);
+
+	len = scan.end;
+	end_headers = nb->buf + len;
 	hbuf = (char *)nb->buf;
 
-	h = kore_split_string(hbuf, "\r\n", headers, HTTP_REQ_HEADER_MAX);
-	if (h < 2) {
+	for (i = 0; i < scan.count; i++)
+		hbuf[scan.lines[i].end] = '\0';
+
+	if (scan.count < 2) {
 		http_error_response(c, 400);
 		return (KORE_RESULT_OK);
 	}
 
-	v = kore_split_string(headers[0], " ", request, 4);
-	if (v != 3) {
+	if (!http_request_line(hbuf + scan.lines[0].start, request)) {
 		http_error_response(c, 400);
 		return (KORE_RESULT_OK);
 	}
 
 	skip = 0;
 	host = NULL;
-	for (i = 0; i < h; i++) {
-		if (strncasecmp(headers[i], "host", 4))
+	for (i = 1; i < scan.count; i++) {
+		line = &scan.lines[i];
+		if (line->colon <= line->start ||
+		    http_header_id(hbuf + line->start,
+		    line->colon - line->start) != HTTP_HDR_HOST)
 			continue;
 
-		if ((host = strchr(headers[i], ':')) == NULL) {
-			http_error_response(c, 400);
-			return (KORE_RESULT_OK);
-		}
-
-		*(host)++ = '\0';
+		hbuf[line->colon] = '\0';
+		for (host = hbuf + line->colon + 1; *host == ' '; host++)
+			;
 
 		if (*host == '\0') {
 			http_error_response(c, 400);
 			return (KORE_RESULT_OK);
 		}
 
-		host++;
 		skip = i;
 		break;
 	}
@@ -741,29 +1223,47 @@ http_header_recv(struct netbuf *nb)
 	    request[0], request[1], request[2], &req))
 		return (KORE_RESULT_OK);
 
-	for (i = 1; i < h; i++) {
+	/*
+	 * The request keeps the header block it was parsed from, host,
+	 * path and all header names and values point into it. Hand the
+	 * connection a fresh buffer carrying whatever followed the headers.
+	 */
+	req->headers = nb->buf;
+	nb->buf = kore_malloc(nb->m_len);
+	nb->s_off -= len;
+	memcpy(nb->buf, end_headers, nb->s_off);
+
+	for (i = 1; i < scan.count; i++) {
 		if (i == skip)
 			continue;
 
-		p = strchr(headers[i], ':');
-		if (p == NULL) {
-			kore_debug("malformed header: '%s'", headers[i]);
+		line = &scan.lines[i];
+		if (line->colon == 0) {
+			kore_debug("malformed header: '%s'",
+			    hbuf + line->start);
 			continue;
 		}
 
-		*(p++) = '\0';
+		hbuf[line->colon] = '\0';
+		p = hbuf + line->colon + 1;
 		if (*p == ' ')
 			p++;
-		hdr = kore_pool_get(&http_header_pool);
-		hdr->header = kore_strdup(headers[i]);
-		hdr->value = kore_strdup(p);
-		TAILQ_INSERT_TAIL(&(req->req_headers), hdr, list);
 
-		if (req->agent == NULL &&
-		    !strcasecmp(hdr->header, "user-agent"))
-			req->agent = hdr->value;
+		id = http_header_id(hbuf + line->start,
+		    line->colon - line->start);
+		if (id != -1 && req->hdr_values[id] == NULL) {
+			req->hdr_values[id] = p;
+			continue;
+		}
+
+		hdr = http_request_arena_alloc(req, sizeof(*hdr));
+		hdr->header = hbuf + line->start;
+		hdr->value = p;
+		TAILQ_INSERT_TAIL(&(req->req_headers), hdr, list);
 	}
 
+	req->agent = req->hdr_values[HTTP_HDR_USER_AGENT];
+
 	if (req->flags & HTTP_REQUEST_EXPECT_BODY) {
 		if (http_body_max == 0) {
 			req->flags |= HTTP_REQUEST_DELETE;
@@ -771,15 +1271,54 @@ http_header_recv(struct netbuf *nb)
 			return (KORE_RESULT_OK);
 		}
 
-		if (!http_request_header(req, "content-length", &p)) {
-			kore_debug("expected body but no content-length");
-			req->flags |= HTTP_REQUEST_DELETE;
-			http_error_response(req->owner, 411);
-			return (KORE_RESULT_OK);
-		}
+		if (http_request_header_id(req,
+		    HTTP_HDR_TRANSFER_ENCODING, &p)) {
+			if (strcasecmp(p, "chunked")) {
+				kore_debug("unsupported transfer-encoding: %s",
+				    p);
+				req->flags |= HTTP_REQUEST_DELETE;
+				http_error_response(req->owner, 501);
+				return (KORE_RESULT_OK);
+			}
 
-		req->content_length = kore_strtonum(p, 10, 0, LONG_MAX, &v);
-		if (v == KORE_RESULT_ERROR) {
+			if (req->hdr_values[HTTP_HDR_CONTENT_LENGTH] != NULL) {
+				kore_debug("both content-length and chunked");
+				req->flags |= HTTP_REQUEST_DELETE;
+				http_error_response(req->owner, 400);
+				return (KORE_RESULT_OK);
+			}
+
+			/*
+			 * The body length is unknown up front, it starts
+			 * out in memory and moves to disk once it grows
+			 * past http_body_disk_offload.
+			 */
+			req->content_length = 0;
+			req->chunk_state = HTTP_CHUNK_SIZE;
+			req->http_body = kore_buf_alloc(NETBUF_SEND_PAYLOAD_MAX);
+
+			if (nb->m_len < NETBUF_SEND_PAYLOAD_MAX) {
+				nb->m_len = NETBUF_SEND_PAYLOAD_MAX;
+				nb->buf = kore_realloc(nb->buf, nb->m_len);
+			}
+
+			nb->cb = http_body_chunk_recv;
+			nb->b_len = nb->m_len;
+			nb->extra = req;
+			http_request_sleep(req);
+
+			return (http_body_chunk_recv(nb));
+		}
+
+		if (!http_request_header_id(req, HTTP_HDR_CONTENT_LENGTH, &p)) {
+			kore_debug("expected body but no content-length");
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_error_response(req->owner, 411);
+			return (KORE_RESULT_OK);
+		}
+
+		req->content_length = kore_strtonum(p, 10, 0, LONG_MAX, &v);
+		if (v == KORE_RESULT_ERROR) {
 			kore_debug("content-length invalid: %s", p);
 			req->flags |= HTTP_REQUEST_DELETE;
 			http_error_response(req->owner, 411);
@@ -801,51 +1340,40 @@ http_header_recv(struct netbuf *nb)
 		}
 
 		req->http_body_length = req->content_length;
+		body = MIN(nb->s_off, req->content_length);
 
 		if (http_body_disk_offload > 0 &&
 		    req->content_length > http_body_disk_offload) {
-			req->http_body_path = kore_pool_get(&http_body_path);
-			l = snprintf(req->http_body_path, HTTP_BODY_PATH_MAX,
-			    "%s/http_body.XXXXXX", http_body_disk_path);
-			if (l == -1 || (size_t)l >= HTTP_BODY_PATH_MAX) {
-				req->flags |= HTTP_REQUEST_DELETE;
-				http_error_response(req->owner, 500);
-				return (KORE_RESULT_ERROR);
-			}
-
-			req->http_body = NULL;
-			req->http_body_fd = mkstemp(req->http_body_path);
-			if (req->http_body_fd == -1) {
-				req->flags |= HTTP_REQUEST_DELETE;
-				http_error_response(req->owner, 500);
-				return (KORE_RESULT_OK);
-			}
-
-			ret = write(req->http_body_fd,
-			    end_headers, (nb->s_off - len));
-			if (ret == -1 || (size_t)ret != (nb->s_off - len)) {
+			if (!http_body_offload(req)) {
 				req->flags |= HTTP_REQUEST_DELETE;
 				http_error_response(req->owner, 500);
 				return (KORE_RESULT_OK);
 			}
 		} else {
-			req->http_body_fd = -1;
 			req->http_body = kore_buf_alloc(req->content_length);
-			kore_buf_append(req->http_body, end_headers,
-			    (nb->s_off - len));
 		}
 
-		bytes_left = req->content_length - (nb->s_off - len);
+		if (!http_body_write(req, nb->buf, body)) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_error_response(req->owner, 500);
+			return (KORE_RESULT_OK);
+		}
+
+		/* Anything past the body is the next pipelined request. */
+		nb->s_off -= body;
+		memmove(nb->buf, nb->buf + body, nb->s_off);
+
+		bytes_left = req->content_length - body;
 		if (bytes_left > 0) {
-			kore_debug("%ld/%ld (%ld - %ld) more bytes for body",
-			    bytes_left, req->content_length, nb->s_off, len);
+			kore_debug("%ld/%ld (%zu) more bytes for body",
+			    bytes_left, req->content_length, body);
 			net_recv_reset(c,
 			    MIN(bytes_left, NETBUF_SEND_PAYLOAD_MAX),
 			    http_body_recv);
 			c->rnb->extra = req;
 			http_request_sleep(req);
 			req->content_length = bytes_left;
-		} else if (bytes_left == 0) {
+		} else {
 			req->flags |= HTTP_REQUEST_COMPLETE;
 			req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
 			if (!http_body_rewind(req)) {
@@ -853,8 +1381,6 @@ http_header_recv(struct netbuf *nb)
 				http_error_response(req->owner, 500);
 				return (KORE_RESULT_OK);
 			}
-		} else {
-			http_error_response(req->owner, 500);
 		}
 	}
 
@@ -1038,17 +1564,17 @@ http_response_cookie(struct http_request *req, const char *name,
 	if (name == NULL || val == NULL)
 		fatal("http_response_cookie: invalid parameters");
 
-	ck = kore_pool_get(&http_cookie_pool);
+	ck = http_request_arena_alloc(req, sizeof(*ck));
 
 	ck->maxage = maxage;
 	ck->expires = expires;
-	ck->name = kore_strdup(name);
-	ck->value = kore_strdup(val);
-	ck->domain = kore_strdup(req->host);
+	ck->name = http_request_arena_strdup(req, name);
+	ck->value = http_request_arena_strdup(req, val);
+	ck->domain = http_request_arena_strdup(req, req->host);
 	ck->flags = HTTP_COOKIE_HTTPONLY | HTTP_COOKIE_SECURE;
 
 	if (path != NULL)
-		ck->path = kore_strdup(path);
+		ck->path = http_request_arena_strdup(req, path);
 	else
 		ck->path = NULL;
 
@@ -1066,10 +1592,10 @@ http_populate_cookies(struct http_request *req)
 	char			*c, *header, *pair[3];
 	char			*cookies[HTTP_MAX_COOKIES];
 
-	if (!http_request_header(req, "cookie", &c))
+	if (!http_request_header_id(req, HTTP_HDR_COOKIE, &c))
 		return;
 
-	header = kore_strdup(c);
+	header = http_request_arena_strdup(req, c);
 	v = kore_split_string(header, ";", cookies, HTTP_MAX_COOKIES);
 	for (i = 0; i < v; i++) {
 		for (c = cookies[i]; isspace(*(unsigned char *)c); c++)
@@ -1079,13 +1605,11 @@ http_populate_cookies(struct http_request *req)
 		if (n != 2)
 			continue;
 
-		ck = kore_pool_get(&http_cookie_pool);
-		ck->name = kore_strdup(pair[0]);
-		ck->value = kore_strdup(pair[1]);
+		ck = http_request_arena_alloc(req, sizeof(*ck));
+		ck->name = pair[0];
+		ck->value = pair[1];
 		TAILQ_INSERT_TAIL(&(req->req_cookies), ck, list);
 	}
-
-	kore_free(header);
 }
 
 void
@@ -1160,7 +1684,7 @@ http_populate_multipart_form(struct http_request *req)
 	if (req->method != HTTP_METHOD_POST)
 		return;
 
-	if (!http_request_header(req, "content-type", &type))
+	if (!http_request_header_id(req, HTTP_HDR_CONTENT_TYPE, &type))
 		return;
 
 	h = kore_split_string(type, ";", args, 3);
@@ -1339,12 +1863,11 @@ multipart_find_data(struct kore_buf *in, struct kore_buf *out,
 {
 	ssize_t			ret;
 	size_t			left;
-	u_int8_t		*p, first, data[4096];
+	u_int8_t		*p, data[4096];
 
 	if (olen != NULL)
 		*olen = 0;
 
-	first = *(const u_int8_t *)needle;
 	for (;;) {
 		if (in->offset < len) {
 			ret = http_body_read(req, data, sizeof(data));
@@ -1357,47 +1880,34 @@ multipart_find_data(struct kore_buf *in, struct kore_buf *out,
 			continue;
 		}
 
-		p = kore_mem_find(in->data, in->offset, &first, 1);
+		p = kore_mem_find(in->data, in->offset, needle, len);
 		if (p == NULL) {
+			/*
+			 * Everything but the last len - 1 bytes (which may
+			 * hold the start of the needle) is data.
+			 */
+			left = in->offset - (len - 1);
 			if (out != NULL)
-				kore_buf_append(out, in->data, in->offset);
-			if (olen != NULL)
-				*olen += in->offset;
-			kore_buf_reset(in);
-			continue;
-		}
-
-		left = in->offset - (p - in->data);
-		if (left < len) {
-			if (out != NULL)
-				kore_buf_append(out, in->data, (p - in->data));
-			if (olen != NULL)
-				*olen += (p - in->data);
-			memmove(in->data, p, left);
-			in->offset = left;
-			continue;
-		}
-
-		if (!memcmp(p, needle, len)) {
-			if (out != NULL)
-				kore_buf_append(out, in->data, p - in->data);
+				kore_buf_append(out, in->data, left);
 			if (olen != NULL)
-				*olen += (p - in->data);
+				*olen += left;
 
-			in->offset = left - len;
+			in->offset = len - 1;
 			if (in->offset > 0)
-				memmove(in->data, p + len, in->offset);
-			return (KORE_RESULT_OK);
+				memmove(in->data, in->data + left, in->offset);
+			continue;
 		}
 
+		left = in->offset - (p - in->data);
 		if (out != NULL)
-			kore_buf_append(out, in->data, (p - in->data) + 1);
+			kore_buf_append(out, in->data, p - in->data);
 		if (olen != NULL)
-			*olen += (p - in->data) + 1;
+			*olen += (p - in->data);
 
-		in->offset = left - 1;
+		in->offset = left - len;
 		if (in->offset > 0)
-			memmove(in->data, p + 1, in->offset);
+			memmove(in->data, p + len, in->offset);
+		return (KORE_RESULT_OK);
 	}
 
 	return (KORE_RESULT_ERROR);
@@ -1512,13 +2022,13 @@ multipart_file_add(struct http_request *req, struct kore_buf *in,
 		return;
 	len -= 2;
 
-	f = kore_malloc(sizeof(struct http_file));
+	f = http_request_arena_alloc(req, sizeof(*f));
 	f->req = req;
 	f->offset = 0;
 	f->length = len;
 	f->position = position;
-	f->name = kore_strdup(name);
-	f->filename = kore_strdup(fname);
+	f->name = http_request_arena_strdup(req, name);
+	f->filename = http_request_arena_strdup(req, fname);
 
 	TAILQ_INSERT_TAIL(&(req->files), f, list);
 }
@@ -1542,31 +2052,164 @@ http_argument_add(struct http_request *req, char *name, char *value)
 		if (!kore_validator_check(req, p->validator, value))
 			break;
 
-		q = kore_malloc(sizeof(struct http_arg));
-		q->name = kore_strdup(name);
-		q->s_value = kore_strdup(value);
+		q = http_request_arena_alloc(req, sizeof(*q));
+		q->name = http_request_arena_strdup(req, name);
+		q->s_value = http_request_arena_strdup(req, value);
 		TAILQ_INSERT_TAIL(&(req->arguments), q, list);
 		break;
 	}
 }
 
+static int
+http_header_id(const char *name, size_t len)
+{
+	int		id;
+
+	if (len == 0)
+		return (-1);
+
+	id = http_hdr_hash[HTTP_HDR_HASH(name, len)];
+	if (id == -1 || http_hdr_names[id].len != len ||
+	    strncasecmp(name, http_hdr_names[id].name, len))
+		return (-1);
+
+	return (id);
+}
+
+static int
+http_request_line(char *line, char **out)
+{
+	int		n;
+	char		*p;
+
+	for (n = 0; n < 3; n++) {
+		while (*line == ' ')
+			line++;
+
+		if (*line == '\0')
+			return (KORE_RESULT_ERROR);
+
+		out[n] = line;
+		if ((p = strchr(line, ' ')) == NULL) {
+			line += strlen(line);
+			continue;
+		}
+
+		*p = '\0';
+		line = p + 1;
+	}
+
+	while (*line == ' ')
+		line++;
+
+	if (*line != '\0')
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Called for every LF or colon in the header block, returns 1 once the
+ * empty line terminating the block has been seen. Lines past the
+ * maximum number of headers are scanned but dropped from the index.
+ */
+static inline int
+http_scan_byte(struct http_scan *scan, const u_int8_t *buf, size_t pos)
+{
+	size_t			end;
+	struct http_scan_line	*line;
+
+	if (buf[pos] == ':') {
+		if (scan->colon == 0)
+			scan->colon = pos;
+		return (0);
+	}
+
+	end = pos;
+	if (end > scan->start && buf[end - 1] == '\r')
+		end--;
+
+	if (end == scan->start) {
+		if (scan->count > 0) {
+			scan->end = pos + 1;
+			return (1);
+		}
+	} else if (scan->count < HTTP_REQ_HEADER_MAX) {
+		line = &scan->lines[scan->count++];
+		line->end = end;
+		line->start = scan->start;
+		line->colon = scan->colon;
+	}
+
+	scan->start = pos + 1;
+	scan->colon = 0;
+
+	return (0);
+}
+
+/*
+ * Looks for LFs and colons 16 bytes at a time where SSE2 is available
+ * (always the case on amd64), the remainder is done bytewise.
+ */
+static int
+http_scan(struct http_scan *scan, const u_int8_t *buf, size_t len)
+{
+	size_t		off;
+#if defined(__SSE2__)
+	u_int32_t	bits;
+	__m128i		v, lf, colon;
+
+	lf = _mm_set1_epi8('\n');
+	colon = _mm_set1_epi8(':');
+
+	for (off = 0; off + 16 <= len; off += 16) {
+		v = _mm_loadu_si128((const __m128i *)(buf + off));
+		bits = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, lf),
+		    _mm_cmpeq_epi8(v, colon)));
+
+		while (bits != 0) {
+			if (http_scan_byte(scan, buf, off + __builtin_ctz(bits)))
+				return (KORE_RESULT_OK);
+			bits &= bits - 1;
+		}
+	}
+#else
+	off = 0;
+#endif
+
+	for (; off < len; off++) {
+		if (buf[off] != '\n' && buf[off] != ':')
+			continue;
+		if (http_scan_byte(scan, buf, off))
+			return (KORE_RESULT_OK);
+	}
+
+	return (KORE_RESULT_ERROR);
+}
+
+static void
+http_request_arena_free(struct http_request *req)
+{
+	struct http_arena	*arena, *next;
+
+	for (arena = req->arena; arena != NULL; arena = next) {
+		next = arena->next;
+		if (arena->len == http_request_arena - sizeof(*arena))
+			kore_pool_put(&http_arena_pool, arena);
+		else
+			kore_free(arena);
+	}
+
+	req->arena = NULL;
+}
+
 static int
 http_body_recv(struct netbuf *nb)
 {
-	ssize_t			ret;
 	u_int64_t		bytes_left;
 	struct http_request	*req = (struct http_request *)nb->extra;
 
-	if (req->http_body_fd != -1) {
-		ret = write(req->http_body_fd, nb->buf, nb->s_off);
-		if (ret == -1 || (size_t)ret != nb->s_off) {
-			req->flags |= HTTP_REQUEST_DELETE;
-			http_error_response(req->owner, 500);
-			return (KORE_RESULT_ERROR);
-		}
-	} else if (req->http_body != NULL) {
-		kore_buf_append(req->http_body, nb->buf, nb->s_off);
-	} else {
+	if (!http_body_write(req, nb->buf, nb->s_off)) {
 		req->flags |= HTTP_REQUEST_DELETE;
 		http_error_response(req->owner, 500);
 		return (KORE_RESULT_ERROR);
@@ -1596,12 +2239,580 @@ http_body_recv(struct netbuf *nb)
 	return (KORE_RESULT_OK);
 }
 
+static int
+http_body_chunk_recv(struct netbuf *nb)
+{
+	ssize_t			ret;
+	int			status;
+	struct http_request	*req = (struct http_request *)nb->extra;
+
+	if ((ret = http_body_chunked(req, nb->buf, nb->s_off, &status)) == -1) {
+		req->flags |= HTTP_REQUEST_DELETE;
+		http_error_response(req->owner, status);
+		return (KORE_RESULT_ERROR);
+	}
+
+	/* Keep a partial chunk-size or trailer line for the next read. */
+	nb->s_off -= ret;
+	memmove(nb->buf, nb->buf + ret, nb->s_off);
+
+	if (req->chunk_state != HTTP_CHUNK_DONE) {
+		if (nb->s_off == nb->b_len) {
+			kore_debug("chunk line too long");
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_error_response(req->owner, 400);
+			return (KORE_RESULT_ERROR);
+		}
+		return (KORE_RESULT_OK);
+	}
+
+	nb->extra = NULL;
+	http_request_wakeup(req);
+	req->flags |= HTTP_REQUEST_COMPLETE;
+	req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
+	req->content_length = req->http_body_length;
+	if (!http_body_rewind(req)) {
+		req->flags |= HTTP_REQUEST_DELETE;
+		http_error_response(req->owner, 500);
+		return (KORE_RESULT_ERROR);
+	}
+
+	/* Anything past the last chunk is the next pipelined request. */
+	nb->cb = http_header_recv;
+	nb->b_len = MAX(http_header_max, nb->s_off);
+	if (nb->b_len > nb->m_len) {
+		nb->m_len = nb->b_len;
+		nb->buf = kore_realloc(nb->buf, nb->m_len);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Decode as much of a chunked request body as buf holds, passing the
+ * chunk data on to the body sinks. Returns the number of bytes used,
+ * a trailing partial line is left alone. On error returns -1 with the
+ * status to answer with in *status.
+ */
+static ssize_t
+http_body_chunked(struct http_request *req, const u_int8_t *buf, size_t len,
+    int *status)
+{
+	const u_int8_t		*line, *eol;
+	size_t			off, llen, n, i, size;
+	int			ch;
+
+	*status = 500;
+	off = 0;
+	while (off < len && req->chunk_state != HTTP_CHUNK_DONE) {
+		if (req->chunk_state == HTTP_CHUNK_DATA) {
+			n = MIN(len - off, req->content_length);
+			if (!http_body_write(req, buf + off, n)) {
+				*status = 500;
+				return (-1);
+			}
+
+			off += n;
+			req->http_body_length += n;
+			req->content_length -= n;
+			if (req->content_length == 0)
+				req->chunk_state = HTTP_CHUNK_DATA_END;
+			continue;
+		}
+
+		if ((eol = memchr(buf + off, '\n', len - off)) == NULL)
+			break;
+
+		line = buf + off;
+		llen = eol - line;
+		off += llen + 1;
+		if (llen > 0 && line[llen - 1] == '\r')
+			llen--;
+
+		switch (req->chunk_state) {
+		case HTTP_CHUNK_SIZE:
+			size = 0;
+			for (i = 0; i < llen && isxdigit(line[i]); i++) {
+				if (size > (http_body_max >> 4)) {
+					*status = 413;
+					return (-1);
+				}
+				ch = tolower(line[i]);
+				size = (size << 4) +
+				    (isdigit(ch) ? ch - '0' : ch - 'a' + 10);
+			}
+
+			/* Chunk extensions are allowed and ignored. */
+			if (i == 0 || (i < llen && line[i] != ';' &&
+			    line[i] != ' ' && line[i] != '\t')) {
+				*status = 400;
+				return (-1);
+			}
+
+			if (size > http_body_max - req->http_body_length) {
+				kore_log(LOG_NOTICE,
+				    "chunked body too large (> %zu)",
+				    http_body_max);
+				*status = 413;
+				return (-1);
+			}
+
+			if (size == 0) {
+				req->chunk_state = HTTP_CHUNK_TRAILER;
+			} else {
+				req->content_length = size;
+				req->chunk_state = HTTP_CHUNK_DATA;
+			}
+			break;
+		case HTTP_CHUNK_DATA_END:
+			if (llen != 0) {
+				*status = 400;
+				return (-1);
+			}
+			req->chunk_state = HTTP_CHUNK_SIZE;
+			break;
+		case HTTP_CHUNK_TRAILER:
+			/* Trailer fields are read and dropped. */
+			if (llen == 0)
+				req->chunk_state = HTTP_CHUNK_DONE;
+			break;
+		default:
+			fatal("http_body_chunked: bad state %d",
+			    req->chunk_state);
+		}
+	}
+
+	return (off);
+}
+
+/*
+ * Move the body to a temporary file under http_body_disk_path, taking
+ * along whatever was already received in memory.
+ */
+static int
+http_body_offload(struct http_request *req)
+{
+	ssize_t		ret;
+	int		len;
+
+	req->http_body_path = kore_pool_get(&http_body_path);
+	len = snprintf(req->http_body_path, HTTP_BODY_PATH_MAX,
+	    "%s/http_body.XXXXXX", http_body_disk_path);
+	if (len == -1 || (size_t)len >= HTTP_BODY_PATH_MAX)
+		return (KORE_RESULT_ERROR);
+
+	req->http_body_fd = mkstemp(req->http_body_path);
+	if (req->http_body_fd == -1) {
+		kore_log(LOG_ERR, "mkstemp(%s): %s",
+		    req->http_body_path, errno_s);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (req->http_body == NULL)
+		return (KORE_RESULT_OK);
+
+	ret = write(req->http_body_fd,
+	    req->http_body->data, req->http_body->offset);
+	if (ret == -1 || (size_t)ret != req->http_body->offset)
+		return (KORE_RESULT_ERROR);
+
+	kore_buf_free(req->http_body);
+	req->http_body = NULL;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http_body_write(struct http_request *req, const void *data, size_t len)
+{
+	ssize_t		ret;
+
+	if (req->http_body != NULL && http_body_disk_offload > 0 &&
+	    req->http_body->offset + len > http_body_disk_offload) {
+		if (!http_body_offload(req))
+			return (KORE_RESULT_ERROR);
+	}
+
+	if (req->http_body_fd != -1) {
+		ret = write(req->http_body_fd, data, len);
+		if (ret == -1 || (size_t)ret != len)
+			return (KORE_RESULT_ERROR);
+	} else if (req->http_body != NULL) {
+		kore_buf_append(req->http_body, data, len);
+	} else {
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http_response_chunk_drained(struct netbuf *nb)
+{
+	http_request_wakeup(nb->extra);
+	return (KORE_RESULT_OK);
+}
+
+static void
+http_response_chunk_queue(struct connection *c, const void *data, size_t len)
+{
+	int		l;
+	char		size[32];
+
+	l = snprintf(size, sizeof(size), "%zx\r\n", len);
+	if (l == -1 || (size_t)l >= sizeof(size))
+		fatal("http_response_chunk_queue: snprintf failed");
+
+	net_send_queue(c, size, l);
+	net_send_queue(c, data, len);
+	net_send_queue(c, "\r\n", 2);
+}
+
+/*
+ * Run data through the deflate stream of a chunked response and queue
+ * whatever comes out. Z_SYNC_FLUSH makes every chunk decodable by the
+ * client as soon as it arrives.
+ */
+static int
+http_response_chunk_deflate(struct http_request *req, const void *data,
+    size_t len, int flush)
+{
+	int		r;
+	size_t		out;
+	z_stream	*strm = &req->deflate->strm;
+
+	if (len > UINT_MAX)
+		return (KORE_RESULT_ERROR);
+
+	http_deflate_reserve(NETBUF_SEND_PAYLOAD_MAX);
+
+	strm->next_in = data;
+	strm->avail_in = len;
+
+	do {
+		strm->next_out = http_deflate_buf;
+		strm->avail_out = http_deflate_buf_len;
+
+		if ((r = deflate(strm, flush)) == Z_STREAM_ERROR)
+			return (KORE_RESULT_ERROR);
+
+		out = http_deflate_buf_len - strm->avail_out;
+		if (out > 0)
+			http_response_chunk_queue(req->owner,
+			    http_deflate_buf, out);
+	} while (strm->avail_out == 0);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Swap the body in *d for a compressed copy if the handler, the content
+ * type and the client allow it and it actually comes out smaller.
+ */
+static void
+http_response_compress(struct http_request *req, int status,
+    const void **d, size_t *len)
+{
+	int			type;
+	size_t			olen;
+	const u_int8_t		*out;
+
+	if (*len < http_compress_min)
+		return;
+
+	if ((type = http_compress_negotiate(req, status)) == 0)
+		return;
+
+	if (!http_compress(type, *d, *len, &out, &olen) || olen >= *len)
+		return;
+
+	http_response_header(req, "content-encoding",
+	    http_compress_names[type]);
+
+	*d = out;
+	*len = olen;
+}
+
+/*
+ * Returns the content-coding to use for the response or 0 if it goes
+ * out as is. Responses that could be compressed get a vary header.
+ */
+static int
+http_compress_negotiate(struct http_request *req, int status)
+{
+	int			i, vary;
+	const char		*type;
+	struct http_header	*hdr;
+
+	if (req->hdlr == NULL ||
+	    (!req->hdlr->compress && !req->hdlr->dom->compress))
+		return (0);
+
+	if (req->method == HTTP_METHOD_HEAD || status < 200 ||
+	    status == 204 || status == 206 || status == 304)
+		return (0);
+
+	vary = 0;
+	type = NULL;
+	TAILQ_FOREACH(hdr, &(req->resp_headers), list) {
+		if (!strcasecmp(hdr->header, "content-encoding"))
+			return (0);
+		if (!strcasecmp(hdr->header, "content-type"))
+			type = hdr->value;
+		if (!strcasecmp(hdr->header, "vary"))
+			vary = 1;
+	}
+
+	if (type == NULL)
+		return (0);
+
+	for (i = 0; http_compress_types[i] != NULL; i++) {
+		if (!strncasecmp(type, http_compress_types[i],
+		    strlen(http_compress_types[i])))
+			break;
+	}
+
+	if (http_compress_types[i] == NULL)
+		return (0);
+
+	if (!vary)
+		http_response_header(req, "vary", "accept-encoding");
+
+	return (http_compress_accepted(req));
+}
+
+/*
+ * Pick gzip or deflate from the accept-encoding header, honoring "*"
+ * and q=0 refusals. gzip wins when both are acceptable.
+ */
+int
+http_compress_accepted(struct http_request *req)
+{
+	char		*ae;
+	const char	*p, *tok;
+	size_t		len;
+	int		gz, df, any, ok;
+
+	if (!http_request_header_id(req, HTTP_HDR_ACCEPT_ENCODING, &ae))
+		return (0);
+
+	p = ae;
+	gz = df = any = -1;
+
+	while (*p != '\0') {
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+
+		tok = p;
+		while (*p != '\0' && *p != ',' && *p != ';' &&
+		    *p != ' ' && *p != '\t')
+			p++;
+		len = p - tok;
+
+		ok = 1;
+		while (*p != '\0' && *p != ',') {
+			if (*p++ != ';')
+				continue;
+			while (*p == ' ' || *p == '\t')
+				p++;
+			if ((*p != 'q' && *p != 'Q') || p[1] != '=')
+				continue;
+			p += 2;
+			if (*p != '0')
+				continue;
+			if (*++p == '.') {
+				for (p++; *p == '0'; p++)
+					;
+			}
+			if (!isdigit(*(const unsigned char *)p))
+				ok = 0;
+		}
+
+		if (len == 4 && !strncasecmp(tok, "gzip", len))
+			gz = ok;
+		else if (len == 6 && !strncasecmp(tok, "x-gzip", len))
+			gz = ok;
+		else if (len == 7 && !strncasecmp(tok, "deflate", len))
+			df = ok;
+		else if (len == 1 && *tok == '*')
+			any = ok;
+	}
+
+	if (gz == 1 || (gz == -1 && any == 1))
+		return (HTTP_COMPRESS_GZIP);
+	if (df == 1 || (df == -1 && any == 1))
+		return (HTTP_COMPRESS_DEFLATE);
+
+	return (0);
+}
+
+/*
+ * Weak comparison of an etag against an if-none-match list as
+ * described in RFC 7232, "*" matches anything.
+ */
+int
+http_etag_match(const char *list, const char *etag)
+{
+	const char	*p, *tok;
+	size_t		len;
+
+	len = strlen(etag);
+	if (len > 2 && etag[0] == 'W' && etag[1] == '/') {
+		etag += 2;
+		len -= 2;
+	}
+
+	p = list;
+	while (*p != '\0') {
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+
+		if (*p == 'W' && p[1] == '/')
+			p += 2;
+
+		tok = p;
+		while (*p != '\0' && *p != ',' && *p != ' ' && *p != '\t')
+			p++;
+
+		if ((size_t)(p - tok) == len && !strncmp(tok, etag, len))
+			return (1);
+		if (p - tok == 1 && *tok == '*')
+			return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * Compress a whole body in one go. On success *out points into a
+ * per-worker buffer that stays valid until the next compression.
+ */
+static int
+http_compress(int type, const void *d, size_t len, const u_int8_t **out,
+    size_t *olen)
+{
+	int			r;
+	struct http_deflate	*dfl;
+
+	if (len > UINT_MAX)
+		return (KORE_RESULT_ERROR);
+
+	if ((dfl = http_deflate_get(type)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	http_deflate_reserve(deflateBound(&dfl->strm, len));
+
+	dfl->strm.next_in = d;
+	dfl->strm.avail_in = len;
+	dfl->strm.next_out = http_deflate_buf;
+	dfl->strm.avail_out = http_deflate_buf_len;
+
+	r = deflate(&dfl->strm, Z_FINISH);
+	*out = http_deflate_buf;
+	*olen = http_deflate_buf_len - dfl->strm.avail_out;
+
+	http_deflate_put(dfl);
+
+	return (r == Z_STREAM_END ? KORE_RESULT_OK : KORE_RESULT_ERROR);
+}
+
+static struct http_deflate *
+http_deflate_get(int type)
+{
+	int			bits;
+	struct http_deflate	*dfl;
+
+	if ((dfl = LIST_FIRST(&http_deflate_idle[type - 1])) != NULL) {
+		LIST_REMOVE(dfl, list);
+		http_deflate_idle_count--;
+		return (dfl);
+	}
+
+	dfl = kore_malloc(sizeof(*dfl));
+	memset(&dfl->strm, 0, sizeof(dfl->strm));
+	dfl->type = type;
+
+	if (type == HTTP_COMPRESS_GZIP)
+		bits = MAX_WBITS + 16;
+	else
+		bits = MAX_WBITS;
+
+	if (deflateInit2(&dfl->strm, http_compress_level,
+	    Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		kore_log(LOG_ERR, "deflateInit2 failed");
+		kore_free(dfl);
+		return (NULL);
+	}
+
+	return (dfl);
+}
+
+static void
+http_deflate_put(struct http_deflate *dfl)
+{
+	if (http_deflate_idle_count >= HTTP_DEFLATE_IDLE_MAX ||
+	    deflateReset(&dfl->strm) != Z_OK) {
+		(void)deflateEnd(&dfl->strm);
+		kore_free(dfl);
+		return;
+	}
+
+	LIST_INSERT_HEAD(&http_deflate_idle[dfl->type - 1], dfl, list);
+	http_deflate_idle_count++;
+}
+
+static void
+http_deflate_reserve(size_t len)
+{
+	if (http_deflate_buf_len >= len)
+		return;
+
+	kore_free(http_deflate_buf);
+	http_deflate_buf_len = len;
+	http_deflate_buf = kore_malloc(http_deflate_buf_len);
+}
+
+static void
+http_pipeline_next(struct connection *c)
+{
+	if (c->state != CONN_STATE_ESTABLISHED || c->proto != CONN_PROTO_HTTP ||
+	    (c->flags & CONN_CLOSE_EMPTY) || c->rnb == NULL ||
+	    c->rnb->cb != http_header_recv)
+		return;
+
+	if (c->flags & CONN_READ_BLOCK) {
+		c->flags &= ~CONN_READ_BLOCK;
+		c->flags |= CONN_READ_POSSIBLE;
+	}
+
+	if (c->rnb->s_off > 0 && http_header_recv(c->rnb) != KORE_RESULT_OK) {
+		kore_connection_disconnect(c);
+		return;
+	}
+
+	if (!net_recv_flush(c)) {
+		kore_connection_disconnect(c);
+		return;
+	}
+
+	/* Make sure a request parsed here runs without waiting for I/O. */
+	if (!TAILQ_EMPTY(&(c->http_requests)))
+		http_requests_left = 1;
+}
+
 static void
 http_error_response(struct connection *c, int status)
 {
 	kore_debug("http_error_response(%p, %d)", c, status);
 
-	c->flags |= CONN_CLOSE_EMPTY;
+	/*
+	 * The connection closes once this is sent, stop reading so the
+	 * bytes left in the receive buffer are never parsed again.
+	 */
+	c->flags |= CONN_CLOSE_EMPTY | CONN_READ_BLOCK;
+	c->flags &= ~CONN_READ_POSSIBLE;
+	if (c->rnb != NULL)
+		c->rnb->s_off = 0;
 
 	switch (c->proto) {
 	case CONN_PROTO_HTTP:
@@ -1637,7 +2848,7 @@ http_response_normal(struct http_request *req, struct connection *c,
 		connection_close = 0;
 
 	if (connection_close == 0 && req != NULL) {
-		if (http_request_header(req, "connection", &conn)) {
+		if (http_request_header_id(req, HTTP_HDR_CONNECTION, &conn)) {
 			if ((*conn == 'c' || *conn == 'C') &&
 			    !strcasecmp(conn, "close"))
 				connection_close = 1;
@@ -1691,7 +2902,8 @@ http_response_normal(struct http_request *req, struct connection *c,
 	if (d != NULL && req != NULL && req->method != HTTP_METHOD_HEAD)
 		net_send_queue(c, d, len);
 
-	if (!(c->flags & CONN_CLOSE_EMPTY))
+	/* Keep any pipelined bytes already read after this request. */
+	if (!(c->flags & CONN_CLOSE_EMPTY) && c->rnb->cb != http_header_recv)
 		net_recv_reset(c, http_header_max, http_header_recv);
 }
 
@@ -41,8 +41,10 @@ struct key {
 };
 
 char				*rand_file = NULL;
+u_int8_t			keymgr_workers = 1;
 
 static TAILQ_HEAD(, key)	keys;
+static struct kore_ticket_key	ticket_keys[KORE_TICKET_KEYS];
 extern volatile sig_atomic_t	sig_recv;
 static int			initialized = 0;
 
@@ -52,7 +54,11 @@ static void	keymgr_save_randfile(void);
 static void	keymgr_load_privatekey(struct kore_domain *);
 static void	keymgr_msg_recv(struct kore_msg *, const void *);
 static void	keymgr_entropy_request(struct kore_msg *, const void *);
+static void	keymgr_ticket_request(struct kore_msg *, const void *);
+static void	keymgr_ticket_rotate(void);
 
+static void	keymgr_respond(struct kore_msg *,
+		    const struct kore_keyreq *, const void *, size_t);
 static void	keymgr_rsa_encrypt(struct kore_msg *, const void *,
 		    struct key *);
 static void	keymgr_ecdsa_sign(struct kore_msg *, const void *,
@@ -62,13 +68,17 @@ void
 kore_keymgr_run(void)
 {
 	int		quit;
-	u_int64_t	now, last_seed;
-
-	if (rand_file != NULL) {
-		keymgr_load_randfile();
-		keymgr_save_randfile();
-	} else {
-		kore_log(LOG_WARNING, "no rand_file location specified");
+	u_int64_t	now, last_seed, last_rotate;
+
+	/* Only the first keymgr owns the rand_file. */
+	if (worker->id == KORE_WORKER_KEYMGR) {
+		if (rand_file != NULL) {
+			keymgr_load_randfile();
+			keymgr_save_randfile();
+		} else {
+			kore_log(LOG_WARNING,
+			    "no rand_file location specified");
+		}
 	}
 
 	quit = 0;
@@ -89,16 +99,32 @@ kore_keymgr_run(void)
 	kore_msg_register(KORE_MSG_KEYMGR_REQ, keymgr_msg_recv);
 	kore_msg_register(KORE_MSG_ENTROPY_REQ, keymgr_entropy_request);
 
+	/* The first keymgr hands out the session ticket keys. */
+	if (worker->id == KORE_WORKER_KEYMGR) {
+		keymgr_ticket_rotate();
+		keymgr_ticket_rotate();
+		kore_msg_register(KORE_MSG_TICKET_REQ, keymgr_ticket_request);
+	}
+
 	last_seed = 0;
+	last_rotate = kore_time_mono_ms();
 	kore_log(LOG_NOTICE, "key manager started");
 
 	while (quit != 1) {
-		now = kore_time_ms();
+		now = kore_time_mono_ms();
 		if ((now - last_seed) > RAND_POLL_INTERVAL) {
 			RAND_poll();
 			last_seed = now;
 		}
 
+		if (worker->id == KORE_WORKER_KEYMGR &&
+		    (now - last_rotate) > KORE_TICKET_ROTATE_TIME) {
+			keymgr_ticket_rotate();
+			kore_msg_send(KORE_MSG_WORKER_ALL, KORE_MSG_TICKET_KEYS,
+			    ticket_keys, sizeof(ticket_keys));
+			last_rotate = now;
+		}
+
 		if (sig_recv != 0) {
 			switch (sig_recv) {
 			case SIGQUIT:
@@ -139,6 +165,8 @@ kore_keymgr_cleanup(void)
 		EVP_PKEY_free(key->pkey);
 		kore_free(key);
 	}
+
+	OPENSSL_cleanse(ticket_keys, sizeof(ticket_keys));
 }
 
 static void
@@ -280,6 +308,28 @@ keymgr_entropy_request(struct kore_msg *msg, const void *data)
 	kore_msg_send(msg->src, KORE_MSG_ENTROPY_RESP, buf, sizeof(buf));
 }
 
+static void
+keymgr_ticket_request(struct kore_msg *msg, const void *data)
+{
+	kore_msg_send(msg->src, KORE_MSG_TICKET_KEYS,
+	    ticket_keys, sizeof(ticket_keys));
+}
+
+static void
+keymgr_ticket_rotate(void)
+{
+	struct kore_ticket_key	*key;
+
+	memmove(&ticket_keys[1], &ticket_keys[0],
+	    sizeof(ticket_keys[0]) * (KORE_TICKET_KEYS - 1));
+
+	key = &ticket_keys[0];
+	if (RAND_bytes(key->name, sizeof(key->name)) != 1 ||
+	    RAND_bytes(key->aes_key, sizeof(key->aes_key)) != 1 ||
+	    RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) != 1)
+		fatal("failed to generate session ticket key: %s", ssl_errno_s);
+}
+
 static void
 keymgr_msg_recv(struct kore_msg *msg, const void *data)
 {
@@ -289,9 +339,15 @@ keymgr_msg_recv(struct kore_msg *msg, const void *data)
 	if (msg->length < sizeof(*req))
 		return;
 
+	/*
+	 * Every request gets an answer, even if it is an empty one, so
+	 * that workers do not have to wait for a signature never coming.
+	 */
 	req = (const struct kore_keyreq *)data;
-	if (msg->length != (sizeof(*req) + req->data_len))
+	if (msg->length != (sizeof(*req) + req->data_len)) {
+		keymgr_respond(msg, req, NULL, 0);
 		return;
+	}
 
 	key = NULL;
 	TAILQ_FOREACH(key, &keys, list) {
@@ -299,8 +355,10 @@ keymgr_msg_recv(struct kore_msg *msg, const void *data)
 			break;
 	}
 
-	if (key == NULL)
+	if (key == NULL) {
+		keymgr_respond(msg, req, NULL, 0);
 		return;
+	}
 
 	switch (EVP_PKEY_id(key->pkey)) {
 	case EVP_PKEY_RSA:
@@ -310,10 +368,31 @@ keymgr_msg_recv(struct kore_msg *msg, const void *data)
 		keymgr_ecdsa_sign(msg, data, key);
 		break;
 	default:
+		keymgr_respond(msg, req, NULL, 0);
 		break;
 	}
 }
 
+static void
+keymgr_respond(struct kore_msg *msg, const struct kore_keyreq *req,
+    const void *data, size_t len)
+{
+	struct kore_keyres	*res;
+	u_int8_t		buf[sizeof(*res) + 1024];
+
+	if (len > sizeof(buf) - sizeof(*res))
+		fatal("keymgr response too large");
+
+	res = (struct kore_keyres *)buf;
+	res->id = req->id;
+	res->data_len = len;
+
+	if (len > 0)
+		memcpy(res->data, data, len);
+
+	kore_msg_send(msg->src, KORE_MSG_KEYMGR_RESP, buf, sizeof(*res) + len);
+}
+
 static void
 keymgr_rsa_encrypt(struct kore_msg *msg, const void *data, struct key *key)
 {
@@ -331,15 +410,19 @@ keymgr_rsa_encrypt(struct kore_msg *msg, const void *data, struct key *key)
 	rsa = key->pkey->pkey.rsa;
 #endif
 	keylen = RSA_size(rsa);
-	if (req->data_len > keylen || keylen > sizeof(buf))
+	if (req->data_len > keylen || keylen > sizeof(buf)) {
+		keymgr_respond(msg, req, NULL, 0);
 		return;
+	}
 
 	ret = RSA_private_encrypt(req->data_len, req->data,
 	    buf, rsa, req->padding);
-	if (ret != RSA_size(rsa))
+	if (ret != RSA_size(rsa)) {
+		keymgr_respond(msg, req, NULL, 0);
 		return;
+	}
 
-	kore_msg_send(msg->src, KORE_MSG_KEYMGR_RESP, buf, ret);
+	keymgr_respond(msg, req, buf, ret);
 }
 
 static void
@@ -358,17 +441,18 @@ keymgr_ecdsa_sign(struct kore_msg *msg, const void *data, struct key *key)
 	ec = key->pkey->pkey.ec;
 #endif
 	len = ECDSA_size(ec);
-	if (req->data_len > len || len > sizeof(sig))
+	if (req->data_len > len || len > sizeof(sig)) {
+		keymgr_respond(msg, req, NULL, 0);
 		return;
+	}
 
 	if (ECDSA_sign(EVP_PKEY_NONE, req->data, req->data_len,
-	    sig, &siglen, ec) == 0)
-		return;
-
-	if (siglen > sizeof(sig))
+	    sig, &siglen, ec) == 0 || siglen > sizeof(sig)) {
+		keymgr_respond(msg, req, NULL, 0);
 		return;
+	}
 
-	kore_msg_send(msg->src, KORE_MSG_KEYMGR_RESP, sig, siglen);
+	keymgr_respond(msg, req, sig, siglen);
 }
 
 #endif
@@ -34,6 +34,12 @@
 #include "python_api.h"
 #endif
 
+#if defined(SO_REUSEPORT_LB)
+#define KORE_SO_REUSEPORT	SO_REUSEPORT_LB
+#elif defined(SO_REUSEPORT)
+#define KORE_SO_REUSEPORT	SO_REUSEPORT
+#endif
+
 volatile sig_atomic_t			sig_recv;
 
 struct listener_head	listeners;
@@ -48,6 +54,8 @@ char			*chroot_path = NULL;
 int			skip_runas = 0;
 char			*runas_user = NULL;
 u_int32_t		kore_socket_backlog = 5000;
+u_int8_t		kore_socket_reuseport = 0;
+u_int8_t		kore_socket_reuseport_cpu = 0;
 char			*kore_pidfile = KORE_PIDFILE_DEFAULT;
 char			*kore_tls_cipher_list = KORE_DEFAULT_CIPHER_LIST;
 
@@ -58,6 +66,9 @@ static void	version(void);
 static void	kore_server_start(void);
 static void	kore_write_kore_pid(void);
 static void	kore_server_sslstart(void);
+#if defined(KORE_SO_REUSEPORT)
+static int	kore_listener_socket(struct listener *);
+#endif
 
 static void
 usage(void)
@@ -300,12 +311,17 @@ kore_server_bind(const char *ip, const char *port, const char *ccb)
 		fatal("getaddrinfo(%s): %s", ip, gai_strerror(r));
 
 	l = kore_malloc(sizeof(struct listener));
+	l->fds = NULL;
 	l->type = KORE_TYPE_LISTENER;
 	l->addrtype = results->ai_family;
 
 	if (l->addrtype != AF_INET && l->addrtype != AF_INET6)
 		fatal("getaddrinfo(): unknown address family %d", l->addrtype);
 
+	if (results->ai_addrlen > sizeof(l->addr))
+		fatal("getaddrinfo(): address too large");
+	memcpy(&l->addr, results->ai_addr, results->ai_addrlen);
+
 	if ((l->fd = socket(results->ai_family, SOCK_STREAM, 0)) == -1) {
 		kore_free(l);
 		freeaddrinfo(results);
@@ -386,16 +402,148 @@ kore_sockopt(int fd, int what, int opt)
 void
 kore_listener_cleanup(void)
 {
+	u_int16_t		i;
 	struct listener		*l;
 
 	while (!LIST_EMPTY(&listeners)) {
 		l = LIST_FIRST(&listeners);
 		LIST_REMOVE(l, list);
-		close(l->fd);
+
+		if (l->fds != NULL) {
+			for (i = 0; l->fds[i] != -1; i++)
+				close(l->fds[i]);
+			kore_free(l->fds);
+		} else {
+			close(l->fd);
+		}
+
 		kore_free(l);
 	}
 }
 
+/*
+ * Replace each listener with one SO_REUSEPORT socket per worker so the
+ * kernel spreads incoming connections across the workers instead of
+ * them taking turns on the accept lock.
+ *
+ * The parent holds on to all of them so a restarted worker picks up the
+ * same socket, including whatever connections are waiting on it.
+ */
+void
+kore_listener_reuseport(u_int16_t count, u_int16_t first)
+{
+	int			steer;
+	u_int16_t		i;
+	struct listener		*l;
+
+#if !defined(KORE_SO_REUSEPORT)
+	fatal("socket_reuseport is not supported on this platform");
+#endif
+
+	/*
+	 * Steering by cpu only reaches every socket if each worker sits
+	 * pinned on a cpu of its own, otherwise keep the default hash.
+	 */
+	steer = kore_socket_reuseport_cpu;
+	if (steer && (count > cpu_count || worker_set_affinity != 1)) {
+		kore_log(LOG_WARNING, "reuseport cpu steering needs pinned "
+		    "workers and no more workers than cpus, not using it");
+		steer = 0;
+	}
+
+	LIST_FOREACH(l, &listeners, list) {
+		close(l->fd);
+
+		l->fds = kore_calloc(count + 1, sizeof(int));
+		for (i = 0; i < count; i++) {
+#if defined(KORE_SO_REUSEPORT)
+			if ((l->fds[i] = kore_listener_socket(l)) == -1)
+#endif
+				fatal("failed to create reuseport listener");
+		}
+
+		l->fds[count] = -1;
+		l->fd = l->fds[0];
+
+		if (steer &&
+		    !kore_platform_reuseport_cpu(l->fd, count, first)) {
+			kore_log(LOG_WARNING,
+			    "reuseport cpu steering unavailable");
+		}
+	}
+}
+
+void
+kore_listener_select(u_int16_t idx)
+{
+	u_int16_t		i;
+	struct listener		*l;
+
+	LIST_FOREACH(l, &listeners, list) {
+		if (l->fds == NULL)
+			continue;
+
+		for (i = 0; l->fds[i] != -1; i++) {
+			if (i == idx)
+				l->fd = l->fds[i];
+			else
+				close(l->fds[i]);
+		}
+
+		kore_free(l->fds);
+		l->fds = NULL;
+	}
+}
+
+#if defined(KORE_SO_REUSEPORT)
+static int
+kore_listener_socket(struct listener *l)
+{
+	int			fd;
+	socklen_t		len;
+
+	if (l->addrtype == AF_INET)
+		len = sizeof(l->addr.ipv4);
+	else
+		len = sizeof(l->addr.ipv6);
+
+	if ((fd = socket(l->addrtype, SOCK_STREAM, 0)) == -1) {
+		kore_log(LOG_ERR, "socket(): %s", errno_s);
+		return (-1);
+	}
+
+	if (!kore_connection_nonblock(fd, 1)) {
+		close(fd);
+		kore_log(LOG_ERR, "kore_connection_nonblock(): %s", errno_s);
+		return (-1);
+	}
+
+	if (!kore_sockopt(fd, SOL_SOCKET, SO_REUSEADDR)) {
+		close(fd);
+		return (-1);
+	}
+
+	if (!kore_sockopt(fd, SOL_SOCKET, KORE_SO_REUSEPORT)) {
+		close(fd);
+		return (-1);
+	}
+
+	if (bind(fd, (struct sockaddr *)&l->addr, len) == -1) {
+		close(fd);
+		kore_log(LOG_ERR, "bind(): %s", errno_s);
+		return (-1);
+	}
+
+	if (listen(fd, kore_socket_backlog) == -1) {
+		close(fd);
+		kore_log(LOG_ERR, "listen(): %s", errno_s);
+		return (-1);
+	}
+
+	return (fd);
+}
+#endif
+
 void
 kore_signal(int sig)
 {
@@ -485,6 +633,7 @@ kore_server_start(void)
 		}
 
 		kore_worker_wait(0);
+		kore_worker_load_report();
 		kore_platform_event_wait(100);
 		kore_connection_prune(KORE_CONNECTION_PRUNE_DISCONNECT);
 	}
@@ -16,6 +16,10 @@
 
 #include <sys/epoll.h>
 #include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include <linux/filter.h>
 
 #include <sched.h>
 
@@ -29,9 +33,11 @@
 #include "tasks.h"
 #endif
 
+#if !defined(KORE_USE_URING)
 static int			efd = -1;
 static u_int32_t		event_count = 0;
 static struct epoll_event	*events = NULL;
+#endif
 
 void
 kore_platform_init(void)
@@ -61,6 +67,43 @@ kore_platform_worker_setcpu(struct kore_worker *kw)
 	}
 }
 
+/*
+ * Attach a BPF program to a SO_REUSEPORT group that steers connections
+ * towards the socket belonging to the worker pinned on the cpu that
+ * handled the packet. Socket i in the group belongs to the worker
+ * running on cpu (i + first) % cpu_count.
+ */
+int
+kore_platform_reuseport_cpu(int fd, u_int16_t count, u_int16_t first)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+	struct sock_fprog	prog;
+	struct sock_filter	code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_ADD | BPF_K, 0, 0, 0 },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, 0 },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+
+	code[1].k = count - (first % count);
+	code[2].k = count;
+
+	prog.filter = code;
+	prog.len = sizeof(code) / sizeof(code[0]);
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+	    &prog, sizeof(prog)) == -1) {
+		kore_log(LOG_ERR, "SO_ATTACH_REUSEPORT_CBPF: %s", errno_s);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+#else
+	return (KORE_RESULT_ERROR);
+#endif
+}
+
+#if !defined(KORE_USE_URING)
 void
 kore_platform_event_init(void)
 {
@@ -95,6 +138,8 @@ kore_platform_event_wait(u_int64_t timer)
 	int			n, i;
 
 	n = epoll_wait(efd, events, event_count, timer);
+	kore_time_update();
+
 	if (n == -1) {
 		if (errno == EINTR)
 			return (0);
@@ -196,6 +241,12 @@ kore_platform_event_all(int fd, void *c)
 	    EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, 0, c);
 }
 
+/* Closing the descriptor takes it out of the epoll set. */
+void
+kore_platform_event_remove(int fd)
+{
+}
+
 void
 kore_platform_event_schedule(int fd, int type, int flags, void *udata)
 {
@@ -258,6 +309,7 @@ kore_platform_disable_accept(void)
 			fatal("kore_platform_disable_accept: %s", errno_s);
 	}
 }
+#endif /* !KORE_USE_URING */
 
 void
 kore_platform_proctitle(char *title)
@@ -266,3 +318,37 @@ kore_platform_proctitle(char *title)
 		kore_debug("prctl(): %s", errno_s);
 	}
 }
+
+int
+kore_platform_sendfile(struct connection *c, struct netbuf *nb,
+    size_t *written)
+{
+	off_t		off;
+	ssize_t		r;
+
+	*written = 0;
+	off = nb->fd_off + (off_t)nb->s_off;
+
+	r = sendfile(c->fd, nb->fd, &off, nb->b_len - nb->s_off);
+	if (r <= -1) {
+		switch (errno) {
+		case EINTR:
+			return (KORE_RESULT_OK);
+		case EAGAIN:
+			c->flags &= ~CONN_WRITE_POSSIBLE;
+			return (KORE_RESULT_OK);
+		default:
+			kore_debug("sendfile(): %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	if (r == 0) {
+		kore_debug("sendfile(): file %d shrunk", nb->fd);
+		return (KORE_RESULT_ERROR);
+	}
+
+	*written = (size_t)r;
+
+	return (KORE_RESULT_OK);
+}
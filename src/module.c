@@ -184,12 +184,19 @@ kore_module_reload(int cbs)
 
 	TAILQ_FOREACH(dom, &domains, list) {
 		TAILQ_FOREACH(hdlr, &(dom->handlers), list) {
+#if !defined(KORE_NO_HTTP)
+			if (hdlr->type == HANDLER_TYPE_FILEMAP)
+				continue;
+#endif
 			kore_free(hdlr->rcall);
 			hdlr->rcall = kore_runtime_getcall(hdlr->func);
 			if (hdlr->rcall == NULL)
 				fatal("no function '%s' found", hdlr->func);
 			hdlr->errors = 0;
 		}
+#if !defined(KORE_NO_HTTP)
+		kore_route_build(dom);
+#endif
 	}
 
 #if !defined(KORE_NO_HTTP)
@@ -231,6 +238,8 @@ kore_module_handler_new(const char *path, const char *domain,
 	hdlr = kore_malloc(sizeof(*hdlr));
 	hdlr->auth = ap;
 	hdlr->dom = dom;
+	hdlr->compress = 0;
+	hdlr->root = NULL;
 	hdlr->errors = 0;
 	hdlr->type = type;
 	hdlr->path = kore_strdup(path);
@@ -245,8 +254,7 @@ kore_module_handler_new(const char *path, const char *domain,
 	}
 
 	if (hdlr->type == HANDLER_TYPE_DYNAMIC) {
-		if (regcomp(&(hdlr->rctx), hdlr->path,
-		    REG_EXTENDED | REG_NOSUB)) {
+		if (regcomp(&(hdlr->rctx), hdlr->path, REG_EXTENDED)) {
 			kore_module_handler_free(hdlr);
 			kore_debug("regcomp() on %s failed", path);
 			return (KORE_RESULT_ERROR);
@@ -254,6 +262,8 @@ kore_module_handler_new(const char *path, const char *domain,
 	}
 
 	TAILQ_INSERT_TAIL(&(dom->handlers), hdlr, list);
+	kore_route_free(dom);
+
 	return (KORE_RESULT_OK);
 }
 
@@ -269,6 +279,8 @@ kore_module_handler_free(struct kore_module_handle *hdlr)
 		kore_free(hdlr->func);
 	if (hdlr->path != NULL)
 		kore_free(hdlr->path);
+	if (hdlr->root != NULL)
+		kore_free(hdlr->root);
 	if (hdlr->type == HANDLER_TYPE_DYNAMIC)
 		regfree(&(hdlr->rctx));
 
@@ -287,22 +299,11 @@ struct kore_module_handle *
 kore_module_handler_find(const char *domain, const char *path)
 {
 	struct kore_domain		*dom;
-	struct kore_module_handle	*hdlr;
 
 	if ((dom = kore_domain_lookup(domain)) == NULL)
 		return (NULL);
 
-	TAILQ_FOREACH(hdlr, &(dom->handlers), list) {
-		if (hdlr->type == HANDLER_TYPE_STATIC) {
-			if (!strcmp(hdlr->path, path))
-				return (hdlr);
-		} else {
-			if (!regexec(&(hdlr->rctx), path, 0, NULL, 0))
-				return (hdlr);
-		}
-	}
-
-	return (NULL);
+	return (kore_route_lookup(dom, path));
 }
 #endif /* !KORE_NO_HTTP */
 
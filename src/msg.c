@@ -72,6 +72,7 @@ kore_msg_parent_add(struct kore_worker *kw)
 	kw->msg[0]->fd = kw->pipe[0];
 	kw->msg[0]->read = net_read;
 	kw->msg[0]->write = net_write;
+	kw->msg[0]->writev = net_writev;
 	kw->msg[0]->proto = CONN_PROTO_MSG;
 	kw->msg[0]->state = CONN_STATE_ESTABLISHED;
 	kw->msg[0]->hdlr_extra = &kw->id;
@@ -103,6 +104,7 @@ kore_msg_worker_init(void)
 	worker->msg[1]->fd = worker->pipe[1];
 	worker->msg[1]->read = net_read;
 	worker->msg[1]->write = net_write;
+	worker->msg[1]->writev = net_writev;
 	worker->msg[1]->proto = CONN_PROTO_MSG;
 	worker->msg[1]->state = CONN_STATE_ESTABLISHED;
 	worker->msg[1]->disconnect = msg_disconnected_parent;
@@ -26,8 +26,15 @@
 #include <sys/endian.h>
 #endif
 
+#include <inttypes.h>
+
 #include "kore.h"
 
+static int	net_send_vector(struct connection *);
+static void	net_send_coalesce(struct connection *);
+static int	net_send_sendfile(struct connection *);
+static int	net_send_file_read(struct connection *);
+
 struct kore_pool		nb_pool;
 
 void
@@ -54,7 +61,7 @@ net_send_queue(struct connection *c, const void *data, size_t len)
 
 	d = data;
 	nb = TAILQ_LAST(&(c->send_queue), netbuf_head);
-	if (nb != NULL && !(nb->flags & NETBUF_IS_STREAM) &&
+	if (nb != NULL && !(nb->flags & (NETBUF_IS_STREAM | NETBUF_IS_FILE)) &&
 	    nb->b_len < nb->m_len) {
 		avail = nb->m_len - nb->b_len;
 		if (len < avail) {
@@ -115,6 +122,32 @@ net_send_stream(struct connection *c, void *data, size_t len,
 		*out = nb;
 }
 
+void
+net_send_file(struct connection *c, int fd, off_t off, size_t len,
+    int (*cb)(struct netbuf *), struct netbuf **out)
+{
+	struct netbuf		*nb;
+
+	kore_debug("net_send_file(%p, %d, %jd, %zu)", c, fd, (intmax_t)off, len);
+
+	nb = kore_pool_get(&nb_pool);
+	nb->cb = cb;
+	nb->fd = fd;
+	nb->fd_off = off;
+	nb->owner = c;
+	nb->s_off = 0;
+	nb->buf = NULL;
+	nb->b_len = len;
+	nb->m_len = nb->b_len;
+	nb->extra = NULL;
+	nb->type = NETBUF_SEND;
+	nb->flags = NETBUF_IS_FILE;
+
+	TAILQ_INSERT_TAIL(&(c->send_queue), nb, list);
+	if (out != NULL)
+		*out = nb;
+}
+
 void
 net_recv_reset(struct connection *c, size_t len, int (*cb)(struct netbuf *))
 {
@@ -177,9 +210,23 @@ net_send(struct connection *c)
 	size_t		r, len, smin;
 
 	c->snb = TAILQ_FIRST(&(c->send_queue));
+	if (c->snb->flags & NETBUF_IS_FILE) {
+		if (c->sendfile != NULL)
+			return (net_send_sendfile(c));
+		if (!net_send_file_read(c))
+			return (KORE_RESULT_ERROR);
+		if (c->snb == NULL)
+			return (KORE_RESULT_OK);
+	}
+
+	if (c->writev != NULL)
+		return (net_send_vector(c));
+
+	net_send_coalesce(c);
+
 	if (c->snb->b_len != 0) {
 		smin = c->snb->b_len - c->snb->s_off;
-		len = MIN(NETBUF_SEND_PAYLOAD_MAX, smin);
+		len = MIN(NETBUF_SEND_RECORD_MAX, smin);
 
 		if (!c->write(c, len, &r))
 			return (KORE_RESULT_ERROR);
@@ -199,6 +246,196 @@ net_send(struct connection *c)
 	return (KORE_RESULT_OK);
 }
 
+/*
+ * Hand as much of the send queue as we can to the kernel in a single
+ * writev() call and drop whatever made it out completely.
+ */
+static int
+net_send_vector(struct connection *c)
+{
+	int			cnt;
+	size_t			r, len;
+	struct netbuf		*nb, *next;
+	struct iovec		iov[NETBUF_SEND_IOV_MAX];
+
+	cnt = 0;
+	TAILQ_FOREACH(nb, &(c->send_queue), list) {
+		if (cnt == NETBUF_SEND_IOV_MAX)
+			break;
+		if (nb->flags & NETBUF_IS_FILE)
+			break;
+		if (nb->s_off == nb->b_len)
+			continue;
+
+		iov[cnt].iov_base = nb->buf + nb->s_off;
+		iov[cnt].iov_len = nb->b_len - nb->s_off;
+		cnt++;
+	}
+
+	r = 0;
+	c->snb = NULL;
+
+	if (cnt > 0) {
+		if (!c->writev(c, iov, cnt, &r))
+			return (KORE_RESULT_ERROR);
+		if (!(c->flags & CONN_WRITE_POSSIBLE))
+			return (KORE_RESULT_OK);
+	}
+
+	for (nb = TAILQ_FIRST(&(c->send_queue)); nb != NULL; nb = next) {
+		next = TAILQ_NEXT(nb, list);
+		if (nb->flags & NETBUF_IS_FILE)
+			break;
+
+		len = nb->b_len - nb->s_off;
+		if (r < len) {
+			nb->s_off += r;
+			break;
+		}
+
+		r -= len;
+		nb->s_off = nb->b_len;
+		net_remove_netbuf(&(c->send_queue), nb);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Before handing a small netbuf to SSL_write() top it up with data from
+ * the netbufs behind it so that we send out full TLS records instead of
+ * one small record per netbuf.
+ */
+static void
+net_send_coalesce(struct connection *c)
+{
+	size_t			len;
+	struct netbuf		*nb, *next, *tmp;
+
+	nb = c->snb;
+	if (nb->flags & (NETBUF_IS_STREAM | NETBUF_MUST_RESEND))
+		return;
+
+	if ((next = TAILQ_NEXT(nb, list)) == NULL)
+		return;
+
+	if ((nb->b_len - nb->s_off) >= NETBUF_SEND_RECORD_MAX)
+		return;
+
+	if (nb->s_off > 0) {
+		memmove(nb->buf, nb->buf + nb->s_off, nb->b_len - nb->s_off);
+		nb->b_len -= nb->s_off;
+		nb->s_off = 0;
+	}
+
+	if (nb->m_len < NETBUF_SEND_RECORD_MAX) {
+		nb->m_len = NETBUF_SEND_RECORD_MAX;
+		nb->buf = kore_realloc(nb->buf, nb->m_len);
+	}
+
+	while (next != NULL && nb->b_len < NETBUF_SEND_RECORD_MAX) {
+		if (next->flags & NETBUF_IS_FILE)
+			break;
+
+		len = MIN(NETBUF_SEND_RECORD_MAX - nb->b_len,
+		    next->b_len - next->s_off);
+
+		memcpy(nb->buf + nb->b_len, next->buf + next->s_off, len);
+		nb->b_len += len;
+		next->s_off += len;
+
+		if (next->s_off != next->b_len)
+			break;
+
+		tmp = TAILQ_NEXT(next, list);
+		net_remove_netbuf(&(c->send_queue), next);
+		next = tmp;
+	}
+}
+
+/*
+ * Let the kernel move file data straight from the page cache into the
+ * socket, without it ever passing through userland.
+ */
+static int
+net_send_sendfile(struct connection *c)
+{
+	size_t		r;
+
+	if (c->snb->s_off < c->snb->b_len) {
+		if (!c->sendfile(c, c->snb, &r))
+			return (KORE_RESULT_ERROR);
+
+		c->snb->s_off += r;
+		if (!(c->flags & CONN_WRITE_POSSIBLE))
+			return (KORE_RESULT_OK);
+	}
+
+	if (c->snb->s_off == c->snb->b_len) {
+		net_remove_netbuf(&(c->send_queue), c->snb);
+		c->snb = NULL;
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Connections that cannot use sendfile() (TLS) get the next record worth
+ * of file data read into a normal netbuf placed in front of the file one.
+ */
+static int
+net_send_file_read(struct connection *c)
+{
+	ssize_t			r;
+	size_t			len;
+	struct netbuf		*nb, *fnb;
+
+	fnb = c->snb;
+	len = MIN(NETBUF_SEND_RECORD_MAX, fnb->b_len - fnb->s_off);
+
+	if (len == 0) {
+		net_remove_netbuf(&(c->send_queue), fnb);
+		c->snb = NULL;
+		return (KORE_RESULT_OK);
+	}
+
+	nb = kore_pool_get(&nb_pool);
+	nb->flags = 0;
+	nb->cb = NULL;
+	nb->owner = c;
+	nb->s_off = 0;
+	nb->b_len = 0;
+	nb->type = NETBUF_SEND;
+	nb->m_len = NETBUF_SEND_RECORD_MAX;
+	nb->buf = kore_malloc(nb->m_len);
+
+	for (;;) {
+		r = pread(fnb->fd, nb->buf, len,
+		    fnb->fd_off + (off_t)fnb->s_off);
+		if (r == -1 && errno == EINTR)
+			continue;
+		break;
+	}
+
+	if (r <= 0) {
+		kore_debug("pread(): %s", r == -1 ? errno_s : "file shrunk");
+		kore_free(nb->buf);
+		kore_pool_put(&nb_pool, nb);
+		return (KORE_RESULT_ERROR);
+	}
+
+	nb->b_len = (size_t)r;
+	fnb->s_off += nb->b_len;
+
+	TAILQ_INSERT_BEFORE(fnb, nb, list);
+	if (fnb->s_off == fnb->b_len)
+		net_remove_netbuf(&(c->send_queue), fnb);
+
+	c->snb = nb;
+
+	return (KORE_RESULT_OK);
+}
+
 int
 net_send_flush(struct connection *c)
 {
@@ -258,12 +495,15 @@ net_remove_netbuf(struct netbuf_head *list, struct netbuf *nb)
 		return;
 	}
 
-	if (!(nb->flags & NETBUF_IS_STREAM)) {
+	if (!(nb->flags & (NETBUF_IS_STREAM | NETBUF_IS_FILE))) {
 		kore_free(nb->buf);
 	} else if (nb->cb != NULL) {
 		(void)nb->cb(nb);
 	}
 
+	if (nb->flags & NETBUF_IS_FILE)
+		(void)close(nb->fd);
+
 	TAILQ_REMOVE(list, nb, list);
 	kore_pool_put(&nb_pool, nb);
 }
@@ -383,6 +623,31 @@ net_write(struct connection *c, size_t len, size_t *written)
 	return (KORE_RESULT_OK);
 }
 
+int
+net_writev(struct connection *c, struct iovec *iov, int cnt, size_t *written)
+{
+	ssize_t		r;
+
+	r = writev(c->fd, iov, cnt);
+	if (r <= -1) {
+		switch (errno) {
+		case EINTR:
+			*written = 0;
+			return (KORE_RESULT_OK);
+		case EAGAIN:
+			c->flags &= ~CONN_WRITE_POSSIBLE;
+			return (KORE_RESULT_OK);
+		default:
+			kore_debug("writev: %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	*written = (size_t)r;
+
+	return (KORE_RESULT_OK);
+}
+
 int
 net_read(struct connection *c, size_t *bytes)
 {
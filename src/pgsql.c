@@ -657,6 +657,7 @@ pgsql_conn_release(struct kore_pgsql *pgsql)
 static void
 pgsql_conn_cleanup(struct pgsql_conn *conn)
 {
+	int			fd;
 	struct kore_pgsql	*pgsql;
 	struct pgsql_db		*pgsqldb;
 
@@ -678,8 +679,11 @@ pgsql_conn_cleanup(struct pgsql_conn *conn)
 		conn->job = NULL;
 	}
 
-	if (conn->db != NULL)
+	if (conn->db != NULL) {
+		if ((fd = PQsocket(conn->db)) != -1)
+			kore_platform_event_remove(fd);
 		PQfinish(conn->db);
+	}
 
 	LIST_FOREACH(pgsqldb, &pgsql_db_conn_strings, rlist) {
 		if (strcmp(pgsqldb->name, conn->name)) {
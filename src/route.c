@@ -0,0 +1,395 @@
+/*
+ * Copyright (c) 2017 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The handlers of a domain compiled into a radix trie.
+ *
+ * Static handlers sit on the node spelling out their path. Dynamic
+ * handlers sit on the node spelling out the literal prefix of their
+ * anchored regex (the root node if they have none) and filemaps on the
+ * node for their prefix. A lookup walks the trie once along the path,
+ * which leaves the exact match and every dynamic handler that could
+ * still match. Only those regexes are run, in configuration order, so
+ * the first handler listed that matches wins just like before.
+ */
+
+#include <sys/param.h>
+
+#include "kore.h"
+#include "http.h"
+
+#define ROUTE_LISTS_MAX		32
+
+struct route_entry {
+	u_int32_t			order;
+	struct kore_module_handle	*hdlr;
+};
+
+struct route_node {
+	char			*label;
+	size_t			len;
+
+	struct route_node	**child;
+	u_int32_t		nchild;
+
+	struct route_entry	exact;
+	struct route_entry	*prefix;
+	u_int32_t		nprefix;
+};
+
+struct kore_route {
+	struct route_node	*root;
+};
+
+static struct route_node	*route_node_new(const char *, size_t);
+static void			route_node_free(struct route_node *);
+static struct route_node	*route_child(struct route_node *, char);
+static void			route_child_add(struct route_node *,
+				    struct route_node *);
+static struct route_node	*route_insert(struct route_node *,
+				    const char *, size_t);
+static void			route_prefix_add(struct route_node *,
+				    u_int32_t, struct kore_module_handle *);
+static size_t			route_regex_prefix(const char *);
+static int			route_match(struct kore_module_handle *,
+				    const char *);
+static struct kore_module_handle	*route_lookup_linear(
+					    struct kore_domain *,
+					    const char *);
+
+void
+kore_route_build(struct kore_domain *dom)
+{
+	size_t				len;
+	u_int32_t			order;
+	struct route_node		*node;
+	struct kore_route		*rt;
+	struct kore_module_handle	*hdlr;
+
+	kore_route_free(dom);
+
+	rt = kore_malloc(sizeof(*rt));
+	rt->root = route_node_new("", 0);
+
+	order = 0;
+	TAILQ_FOREACH(hdlr, &(dom->handlers), list) {
+		switch (hdlr->type) {
+		case HANDLER_TYPE_STATIC:
+			node = route_insert(rt->root,
+			    hdlr->path, strlen(hdlr->path));
+			if (node->exact.hdlr == NULL) {
+				node->exact.hdlr = hdlr;
+				node->exact.order = order;
+			}
+			break;
+		case HANDLER_TYPE_FILEMAP:
+			node = route_insert(rt->root,
+			    hdlr->path, strlen(hdlr->path));
+			route_prefix_add(node, order, hdlr);
+			break;
+		case HANDLER_TYPE_DYNAMIC:
+			len = route_regex_prefix(hdlr->path);
+			node = route_insert(rt->root, hdlr->path + 1, len);
+			route_prefix_add(node, order, hdlr);
+			break;
+		default:
+			fatal("kore_route_build: unknown handler type %d",
+			    hdlr->type);
+		}
+
+		order++;
+	}
+
+	dom->routes = rt;
+}
+
+void
+kore_route_free(struct kore_domain *dom)
+{
+	if (dom->routes == NULL)
+		return;
+
+	route_node_free(dom->routes->root);
+	kore_free(dom->routes);
+	dom->routes = NULL;
+}
+
+struct kore_module_handle *
+kore_route_lookup(struct kore_domain *dom, const char *path)
+{
+	const char		*p;
+	struct route_entry	*exact, *best;
+	struct route_node	*node, *child, *lists[ROUTE_LISTS_MAX];
+	u_int32_t		i, n, bi, idx[ROUTE_LISTS_MAX];
+
+	if (dom->routes == NULL)
+		kore_route_build(dom);
+
+	n = 0;
+	p = path;
+	exact = NULL;
+	node = dom->routes->root;
+
+	for (;;) {
+		if (node->nprefix > 0) {
+			if (n == ROUTE_LISTS_MAX)
+				return (route_lookup_linear(dom, path));
+			idx[n] = 0;
+			lists[n++] = node;
+		}
+
+		if (*p == '\0') {
+			if (node->exact.hdlr != NULL)
+				exact = &node->exact;
+			break;
+		}
+
+		if ((child = route_child(node, *p)) == NULL ||
+		    strncmp(p, child->label, child->len))
+			break;
+
+		p += child->len;
+		node = child;
+	}
+
+	/* Merge the candidate lists in configuration order. */
+	for (;;) {
+		bi = 0;
+		best = NULL;
+		for (i = 0; i < n; i++) {
+			if (idx[i] == lists[i]->nprefix)
+				continue;
+			if (best == NULL ||
+			    lists[i]->prefix[idx[i]].order < best->order) {
+				best = &lists[i]->prefix[idx[i]];
+				bi = i;
+			}
+		}
+
+		if (best == NULL)
+			break;
+
+		if (exact != NULL && exact->order < best->order)
+			return (exact->hdlr);
+
+		idx[bi]++;
+		if (route_match(best->hdlr, path))
+			return (best->hdlr);
+	}
+
+	if (exact != NULL)
+		return (exact->hdlr);
+
+	return (NULL);
+}
+
+static struct route_node *
+route_node_new(const char *label, size_t len)
+{
+	struct route_node	*node;
+
+	node = kore_malloc(sizeof(*node));
+	node->label = kore_malloc(len + 1);
+	memcpy(node->label, label, len);
+	node->label[len] = '\0';
+	node->len = len;
+
+	node->child = NULL;
+	node->nchild = 0;
+	node->exact.hdlr = NULL;
+	node->exact.order = 0;
+	node->prefix = NULL;
+	node->nprefix = 0;
+
+	return (node);
+}
+
+static void
+route_node_free(struct route_node *node)
+{
+	u_int32_t	i;
+
+	for (i = 0; i < node->nchild; i++)
+		route_node_free(node->child[i]);
+
+	kore_free(node->child);
+	kore_free(node->prefix);
+	kore_free(node->label);
+	kore_free(node);
+}
+
+static struct route_node *
+route_child(struct route_node *node, char c)
+{
+	u_int32_t	i;
+
+	for (i = 0; i < node->nchild; i++) {
+		if (node->child[i]->label[0] == c)
+			return (node->child[i]);
+	}
+
+	return (NULL);
+}
+
+static void
+route_child_add(struct route_node *node, struct route_node *child)
+{
+	node->child = kore_realloc(node->child,
+	    (node->nchild + 1) * sizeof(*node->child));
+	node->child[node->nchild++] = child;
+}
+
+static struct route_node *
+route_insert(struct route_node *node, const char *key, size_t len)
+{
+	char			*label;
+	size_t			n;
+	u_int32_t		i;
+	struct route_node	*child, *split;
+
+	while (len > 0) {
+		if ((child = route_child(node, *key)) == NULL) {
+			child = route_node_new(key, len);
+			route_child_add(node, child);
+			return (child);
+		}
+
+		for (n = 0; n < child->len && n < len; n++) {
+			if (child->label[n] != key[n])
+				break;
+		}
+
+		/* Split the edge where the key diverges from it. */
+		if (n < child->len) {
+			split = route_node_new(child->label, n);
+
+			label = kore_strdup(child->label + n);
+			kore_free(child->label);
+			child->label = label;
+			child->len -= n;
+
+			for (i = 0; i < node->nchild; i++) {
+				if (node->child[i] == child)
+					node->child[i] = split;
+			}
+
+			route_child_add(split, child);
+			child = split;
+		}
+
+		node = child;
+		key += n;
+		len -= n;
+	}
+
+	return (node);
+}
+
+static void
+route_prefix_add(struct route_node *node, u_int32_t order,
+    struct kore_module_handle *hdlr)
+{
+	node->prefix = kore_realloc(node->prefix,
+	    (node->nprefix + 1) * sizeof(*node->prefix));
+	node->prefix[node->nprefix].order = order;
+	node->prefix[node->nprefix].hdlr = hdlr;
+	node->nprefix++;
+}
+
+/*
+ * Returns the length of the literal prefix that any path matching the
+ * regex must start with, 0 if there is none. A literal followed by an
+ * optional quantifier does not count, nor does anything if the regex
+ * has an alternation at its top level.
+ */
+static size_t
+route_regex_prefix(const char *re)
+{
+	size_t		len;
+	int		depth;
+	const char	*p;
+
+	if (*re != '^')
+		return (0);
+
+	depth = 0;
+	for (p = re; *p != '\0'; p++) {
+		switch (*p) {
+		case '\\':
+			if (p[1] != '\0')
+				p++;
+			break;
+		case '[':
+			p++;
+			if (*p == '^')
+				p++;
+			if (*p == ']')
+				p++;
+			while (*p != '\0' && *p != ']')
+				p++;
+			if (*p == '\0')
+				return (0);
+			break;
+		case '(':
+			depth++;
+			break;
+		case ')':
+			depth--;
+			break;
+		case '|':
+			if (depth == 0)
+				return (0);
+			break;
+		}
+	}
+
+	for (len = 0, p = re + 1; *p != '\0'; p++, len++) {
+		if (strchr(".[]()*+?{}|\\^$", *p) != NULL)
+			break;
+	}
+
+	if (len > 0 && (*p == '*' || *p == '?' || *p == '{'))
+		len--;
+
+	return (len);
+}
+
+static int
+route_match(struct kore_module_handle *hdlr, const char *path)
+{
+	if (hdlr->type == HANDLER_TYPE_FILEMAP)
+		return (kore_filemap_match(hdlr, path));
+
+	return (!regexec(&(hdlr->rctx), path, 0, NULL, 0));
+}
+
+/* For paths with more candidate lists than a lookup keeps track of. */
+static struct kore_module_handle *
+route_lookup_linear(struct kore_domain *dom, const char *path)
+{
+	struct kore_module_handle	*hdlr;
+
+	TAILQ_FOREACH(hdlr, &(dom->handlers), list) {
+		if (hdlr->type == HANDLER_TYPE_STATIC) {
+			if (!strcmp(hdlr->path, path))
+				return (hdlr);
+		} else if (route_match(hdlr, path)) {
+			return (hdlr);
+		}
+	}
+
+	return (NULL);
+}
@@ -134,6 +134,7 @@ kore_task_destroy(struct kore_task *t)
 	pthread_rwlock_wrlock(&(t->lock));
 
 	if (t->fds[0] != -1) {
+		kore_platform_event_remove(t->fds[0]);
 		(void)close(t->fds[0]);
 		t->fds[0] = -1;
 	}
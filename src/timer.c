@@ -14,24 +14,55 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/*
+ * Timers are kept in a hierarchical timing wheel with a 1ms tick.
+ *
+ * Level 0 holds the timers expiring within the next 256 ticks, one slot
+ * per tick. Each level above covers 256 times the range of the one below
+ * it, its timers are cascaded down a level whenever the level below wraps
+ * around. Adding and removing a timer is O(1), running them is O(expired).
+ */
+
 #include <sys/param.h>
 #include <sys/queue.h>
 
 #include "kore.h"
 
-TAILQ_HEAD(timerlist, kore_timer)	kore_timers;
+#define TIMER_LEVELS		4
+#define TIMER_SLOT_BITS		8
+#define TIMER_SLOTS		(1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK		(TIMER_SLOTS - 1)
+#define TIMER_MAX_TICKS		0xffffffffULL
+
+#define TIMER_INDEX(t, l)	\
+	(((t) >> ((l) * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK)
+
+LIST_HEAD(timerlist, kore_timer);
+
+static void	timer_insert(struct kore_timer *);
+static int	timer_cascade(int);
+
+static struct timerlist		wheel[TIMER_LEVELS][TIMER_SLOTS];
+static u_int64_t		wheel_tick;
 
 void
 kore_timer_init(void)
 {
-	TAILQ_INIT(&kore_timers);
+	int		l, i;
+
+	for (l = 0; l < TIMER_LEVELS; l++) {
+		for (i = 0; i < TIMER_SLOTS; i++)
+			LIST_INIT(&wheel[l][i]);
+	}
+
+	wheel_tick = kore_time_mono_ms();
 }
 
 struct kore_timer *
 kore_timer_add(void (*cb)(void *, u_int64_t), u_int64_t interval,
     void *arg, int flags)
 {
-	struct kore_timer	*timer, *t;
+	struct kore_timer	*timer;
 
 	timer = kore_malloc(sizeof(*timer));
 
@@ -39,56 +70,77 @@ kore_timer_add(void (*cb)(void *, u_int64_t), u_int64_t interval,
 	timer->arg = arg;
 	timer->flags = flags;
 	timer->interval = interval;
-	timer->nextrun = kore_time_ms() + timer->interval;
+	timer->nextrun = kore_time_mono_ms() + timer->interval;
 
-	TAILQ_FOREACH(t, &kore_timers, list) {
-		if (t->nextrun > timer->nextrun) {
-			TAILQ_INSERT_BEFORE(t, timer, list);
-			return (timer);
-		}
-	}
+	timer_insert(timer);
 
-	TAILQ_INSERT_TAIL(&kore_timers, timer, list);
 	return (timer);
 }
 
 void
 kore_timer_remove(struct kore_timer *timer)
 {
-	TAILQ_REMOVE(&kore_timers, timer, list);
+	LIST_REMOVE(timer, list);
 	kore_free(timer);
 }
 
 u_int64_t
 kore_timer_run(u_int64_t now)
 {
-	struct kore_timer	*timer, *t;
-	u_int64_t		next_timer;
+	struct timerlist	expired;
+	struct kore_timer	*timer;
+	u_int64_t		next_timer, wall;
+	int			i, idx;
+
+	wall = 0;
+
+	while (wheel_tick <= now) {
+		idx = TIMER_INDEX(wheel_tick, 0);
+
+		/* Pull the next stretch of timers down from higher levels. */
+		for (i = 1; idx == 0 && i < TIMER_LEVELS; i++)
+			idx = timer_cascade(i);
+
+		idx = TIMER_INDEX(wheel_tick, 0);
+		wheel_tick++;
+
+		/*
+		 * Detach the slot first, callbacks may add timers that
+		 * land in it or remove timers that are still pending.
+		 */
+		LIST_INIT(&expired);
+		while ((timer = LIST_FIRST(&wheel[0][idx])) != NULL) {
+			LIST_REMOVE(timer, list);
+			LIST_INSERT_HEAD(&expired, timer, list);
+		}
 
-	next_timer = 100;
+		while ((timer = LIST_FIRST(&expired)) != NULL) {
+			LIST_REMOVE(timer, list);
 
-	while ((timer = TAILQ_FIRST(&kore_timers)) != NULL) {
-		if (timer->nextrun > now) {
-			next_timer = timer->nextrun - now;
-			break;
-		}
+			/* Callbacks get the wall clock, like kore_time_ms(). */
+			if (wall == 0)
+				wall = kore_time_ms();
+			timer->cb(timer->arg, wall);
 
-		TAILQ_REMOVE(&kore_timers, timer, list);
-		timer->cb(timer->arg, now);
-
-		if (timer->flags & KORE_TIMER_ONESHOT) {
-			kore_free(timer);
-		} else {
-			timer->nextrun = now + timer->interval;
-			TAILQ_FOREACH(t, &kore_timers, list) {
-				if (t->nextrun > timer->nextrun) {
-					TAILQ_INSERT_BEFORE(t, timer, list);
-					break;
-				}
+			if (timer->flags & KORE_TIMER_ONESHOT) {
+				kore_free(timer);
+			} else {
+				timer->nextrun = now + timer->interval;
+				timer_insert(timer);
 			}
+		}
+	}
 
-			if (t == NULL)
-				TAILQ_INSERT_TAIL(&kore_timers, timer, list);
+	/*
+	 * Level 0 only holds timers expiring before the next cascade, so
+	 * the first occupied slot (or the cascade itself) is when to wake.
+	 */
+	next_timer = 100;
+	for (i = 0; i < 100; i++) {
+		idx = TIMER_INDEX(wheel_tick + i, 0);
+		if (!LIST_EMPTY(&wheel[0][idx]) || (i > 0 && idx == 0)) {
+			next_timer = (wheel_tick + i) - now;
+			break;
 		}
 	}
 
@@ -97,3 +149,45 @@ kore_timer_run(u_int64_t now)
 
 	return (next_timer);
 }
+
+static void
+timer_insert(struct kore_timer *timer)
+{
+	u_int64_t	expires, delta;
+	int		l;
+
+	expires = timer->nextrun;
+	if (expires < wheel_tick)
+		expires = wheel_tick;
+
+	delta = expires - wheel_tick;
+	if (delta > TIMER_MAX_TICKS) {
+		delta = TIMER_MAX_TICKS;
+		expires = wheel_tick + delta;
+	}
+
+	for (l = 0; l < TIMER_LEVELS - 1; l++) {
+		if (delta < (1ULL << ((l + 1) * TIMER_SLOT_BITS)))
+			break;
+	}
+
+	LIST_INSERT_HEAD(&wheel[l][TIMER_INDEX(expires, l)], timer, list);
+}
+
+static int
+timer_cascade(int level)
+{
+	struct timerlist	*slot;
+	struct kore_timer	*timer;
+	int			idx;
+
+	idx = TIMER_INDEX(wheel_tick, level);
+	slot = &wheel[level][idx];
+
+	while ((timer = LIST_FIRST(slot)) != NULL) {
+		LIST_REMOVE(timer, list);
+		timer_insert(timer);
+	}
+
+	return (idx);
+}
@@ -0,0 +1,587 @@
+/*
+ * Copyright (c) 2017 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * io_uring event backend, used instead of the epoll one in linux.c when
+ * built with URING=1.
+ *
+ * Every descriptor gets a multishot poll request and listeners get a
+ * multishot accept, so readiness changes and new connections arrive as
+ * completions without any epoll_ctl() or accept() calls. All requests
+ * queued during an iteration are submitted together with the wait.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include <poll.h>
+#include <stdint.h>
+
+#include "kore.h"
+
+#if defined(KORE_USE_PGSQL)
+#include "pgsql.h"
+#endif
+
+#if defined(KORE_USE_TASKS)
+#include "tasks.h"
+#endif
+
+#define URING_SQ_ENTRIES	1024
+#define URING_CQ_ENTRIES	16384
+
+#define URING_OP_POLL		1
+#define URING_OP_ACCEPT		2
+
+#define URING_OP_DEAD		0x01
+
+/* Set on the user_data of cancel requests, ops are at least 8 aligned. */
+#define URING_CANCEL_TAG	0x01
+
+/*
+ * An op is referenced by its armed request and by a pending cancel,
+ * it is only freed once the kernel let go of both.
+ */
+struct uring_op {
+	int			fd;
+	u_int8_t		type;
+	u_int8_t		flags;
+	u_int32_t		refs;
+	u_int32_t		events;
+	void			*udata;
+};
+
+static void		uring_arm(struct uring_op *);
+static void		uring_release(struct uring_op *);
+static int		uring_enter(u_int32_t, u_int64_t);
+static struct io_uring_sqe	*uring_sqe(void);
+static void		uring_add(int, u_int8_t, u_int32_t, void *);
+static void		uring_remove(int);
+static u_int32_t	uring_accept(struct uring_op *, int);
+static u_int32_t	uring_poll(struct uring_op *, int);
+
+static int			ufd = -1;
+static int			uring_multishot = 1;
+static struct uring_op		**uring_fds = NULL;
+static int			uring_fds_len = 0;
+
+static void			*sq_ring = NULL;
+static void			*cq_ring = NULL;
+static size_t			sq_ring_len = 0;
+static size_t			cq_ring_len = 0;
+static struct io_uring_sqe	*sqes = NULL;
+static size_t			sqes_len = 0;
+
+static u_int32_t		*sq_head, *sq_tail, *sq_array, sq_mask;
+static u_int32_t		sq_entries, sq_local;
+static u_int32_t		*cq_head, *cq_tail, cq_mask;
+static struct io_uring_cqe	*cqes;
+
+void
+kore_platform_event_init(void)
+{
+	u_int32_t		i;
+	struct io_uring_params	p;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_CQ_ENTRIES;
+
+	ufd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+	if (ufd == -1)
+		fatal("io_uring_setup(): %s", errno_s);
+
+	if (!(p.features & IORING_FEAT_EXT_ARG))
+		fatal("io_uring: kernel lacks IORING_FEAT_EXT_ARG");
+
+	sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(u_int32_t);
+	cq_ring_len = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		sq_ring_len = MAX(sq_ring_len, cq_ring_len);
+		cq_ring_len = sq_ring_len;
+	}
+
+	sq_ring = mmap(NULL, sq_ring_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ufd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+		fatal("mmap(): sq ring %s", errno_s);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ring = sq_ring;
+	} else {
+		cq_ring = mmap(NULL, cq_ring_len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ufd, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED)
+			fatal("mmap(): cq ring %s", errno_s);
+	}
+
+	sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ufd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		fatal("mmap(): sqes %s", errno_s);
+
+	sq_head = (u_int32_t *)((u_int8_t *)sq_ring + p.sq_off.head);
+	sq_tail = (u_int32_t *)((u_int8_t *)sq_ring + p.sq_off.tail);
+	sq_array = (u_int32_t *)((u_int8_t *)sq_ring + p.sq_off.array);
+	sq_mask = *(u_int32_t *)((u_int8_t *)sq_ring + p.sq_off.ring_mask);
+	sq_entries = p.sq_entries;
+	sq_local = *sq_tail;
+
+	cq_head = (u_int32_t *)((u_int8_t *)cq_ring + p.cq_off.head);
+	cq_tail = (u_int32_t *)((u_int8_t *)cq_ring + p.cq_off.tail);
+	cq_mask = *(u_int32_t *)((u_int8_t *)cq_ring + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)((u_int8_t *)cq_ring + p.cq_off.cqes);
+
+	for (i = 0; i < sq_entries; i++)
+		sq_array[i] = i;
+}
+
+void
+kore_platform_event_cleanup(void)
+{
+	int		fd;
+
+	if (ufd != -1) {
+		close(ufd);
+		ufd = -1;
+	}
+
+	if (sqes != NULL) {
+		(void)munmap(sqes, sqes_len);
+		sqes = NULL;
+	}
+
+	if (cq_ring != NULL && cq_ring != sq_ring)
+		(void)munmap(cq_ring, cq_ring_len);
+	cq_ring = NULL;
+
+	if (sq_ring != NULL) {
+		(void)munmap(sq_ring, sq_ring_len);
+		sq_ring = NULL;
+	}
+
+	for (fd = 0; fd < uring_fds_len; fd++)
+		kore_free(uring_fds[fd]);
+
+	kore_free(uring_fds);
+	uring_fds = NULL;
+	uring_fds_len = 0;
+}
+
+int
+kore_platform_event_wait(u_int64_t timer)
+{
+	struct uring_op		*op;
+	u_int64_t		udata;
+	u_int32_t		r, head, tail, flags;
+	int			res, wait;
+
+	wait = (timer > 0 &&
+	    *cq_head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE));
+
+	if (uring_enter(wait, timer) == -1) {
+		switch (errno) {
+		case EINTR:
+			kore_time_update();
+			return (0);
+		case ETIME:
+		case EBUSY:
+		case EAGAIN:
+			break;
+		default:
+			fatal("io_uring_enter(): %s", errno_s);
+		}
+	}
+
+	kore_time_update();
+
+	r = 0;
+	head = *cq_head;
+	tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		udata = cqes[head & cq_mask].user_data;
+		res = cqes[head & cq_mask].res;
+		flags = cqes[head & cq_mask].flags;
+
+		head++;
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+		if (udata & URING_CANCEL_TAG) {
+			op = (struct uring_op *)(uintptr_t)
+			    (udata & ~(u_int64_t)URING_CANCEL_TAG);
+			uring_release(op);
+			continue;
+		}
+
+		op = (struct uring_op *)(uintptr_t)udata;
+
+		if (!(op->flags & URING_OP_DEAD)) {
+			switch (op->type) {
+			case URING_OP_ACCEPT:
+				r += uring_accept(op, res);
+				break;
+			case URING_OP_POLL:
+				r += uring_poll(op, res);
+				break;
+			default:
+				fatal("wrong uring op type %d", op->type);
+			}
+		} else if (op->type == URING_OP_ACCEPT && res >= 0) {
+			/* Accepted before our cancel went through. */
+			r += uring_accept(op, res);
+		}
+
+		if (!(flags & IORING_CQE_F_MORE)) {
+			/* The request is done, rearm it if still wanted. */
+			if (!(op->flags & URING_OP_DEAD))
+				uring_arm(op);
+			uring_release(op);
+		}
+	}
+
+	return (r);
+}
+
+void
+kore_platform_event_all(int fd, void *c)
+{
+	kore_platform_event_schedule(fd, POLLIN | POLLOUT | POLLRDHUP, 0, c);
+}
+
+void
+kore_platform_event_remove(int fd)
+{
+	uring_remove(fd);
+}
+
+void
+kore_platform_event_schedule(int fd, int type, int flags, void *udata)
+{
+	kore_debug("kore_platform_event_schedule(%d, %d, %d, %p)",
+	    fd, type, flags, udata);
+
+	uring_remove(fd);
+	uring_add(fd, URING_OP_POLL, type, udata);
+}
+
+void
+kore_platform_schedule_read(int fd, void *data)
+{
+	kore_platform_event_schedule(fd, POLLIN, 0, data);
+}
+
+void
+kore_platform_schedule_write(int fd, void *data)
+{
+	kore_platform_event_schedule(fd, POLLOUT, 0, data);
+}
+
+void
+kore_platform_disable_read(int fd)
+{
+	uring_remove(fd);
+}
+
+void
+kore_platform_enable_accept(void)
+{
+	struct listener		*l;
+
+	kore_debug("kore_platform_enable_accept()");
+
+	LIST_FOREACH(l, &listeners, list) {
+		uring_remove(l->fd);
+		if (uring_multishot)
+			uring_add(l->fd, URING_OP_ACCEPT, 0, l);
+		else
+			uring_add(l->fd, URING_OP_POLL, POLLIN, l);
+	}
+}
+
+void
+kore_platform_disable_accept(void)
+{
+	struct listener		*l;
+
+	kore_debug("kore_platform_disable_accept()");
+
+	LIST_FOREACH(l, &listeners, list)
+		uring_remove(l->fd);
+}
+
+static u_int32_t
+uring_accept(struct uring_op *op, int res)
+{
+	struct connection	*c;
+	struct listener		*l = op->udata;
+
+	if (res == -EINVAL && !(op->flags & URING_OP_DEAD)) {
+		/* No multishot accept (< 5.19), poll the listener instead. */
+		kore_debug("multishot accept unavailable, polling listeners");
+		uring_multishot = 0;
+		op->type = URING_OP_POLL;
+		op->events = POLLIN;
+		return (0);
+	}
+
+	if (res < 0) {
+		kore_debug("accept(): %s", strerror(-res));
+		return (0);
+	}
+
+	if (worker_active_connections >= worker_max_connections) {
+		kore_debug("accept(): over worker_max_connections");
+		close(res);
+		return (0);
+	}
+
+	if (!kore_connection_accept_fd(l, res, &c))
+		return (0);
+
+	kore_platform_event_all(c->fd, c);
+
+	return (1);
+}
+
+static u_int32_t
+uring_poll(struct uring_op *op, int res)
+{
+	struct connection	*c;
+	struct listener		*l;
+	u_int8_t		type;
+	u_int32_t		r;
+
+	r = 0;
+	type = *(u_int8_t *)op->udata;
+
+	if (res < 0 || (res & (POLLERR | POLLHUP))) {
+		switch (type) {
+		case KORE_TYPE_LISTENER:
+			fatal("failed on listener socket");
+			/* NOTREACHED */
+#if defined(KORE_USE_PGSQL)
+		case KORE_TYPE_PGSQL_CONN:
+			kore_pgsql_handle(op->udata, 1);
+			break;
+#endif
+#if defined(KORE_USE_TASKS)
+		case KORE_TYPE_TASK:
+			kore_task_handle(op->udata, 1);
+			break;
+#endif
+		default:
+			c = (struct connection *)op->udata;
+			kore_connection_disconnect(c);
+			break;
+		}
+
+		return (0);
+	}
+
+	switch (type) {
+	case KORE_TYPE_LISTENER:
+		l = (struct listener *)op->udata;
+
+		while (worker_active_connections < worker_max_connections) {
+			if (worker_accept_threshold != 0 &&
+			    r >= worker_accept_threshold)
+				break;
+
+			if (!kore_connection_accept(l, &c))
+				break;
+
+			if (c == NULL)
+				break;
+
+			r++;
+			kore_platform_event_all(c->fd, c);
+		}
+		break;
+	case KORE_TYPE_CONNECTION:
+		c = (struct connection *)op->udata;
+		if (res & POLLIN && !(c->flags & CONN_READ_BLOCK))
+			c->flags |= CONN_READ_POSSIBLE;
+		if (res & POLLOUT && !(c->flags & CONN_WRITE_BLOCK))
+			c->flags |= CONN_WRITE_POSSIBLE;
+
+		if (c->handle != NULL && !c->handle(c))
+			kore_connection_disconnect(c);
+		break;
+#if defined(KORE_USE_PGSQL)
+	case KORE_TYPE_PGSQL_CONN:
+		kore_pgsql_handle(op->udata, 0);
+		break;
+#endif
+#if defined(KORE_USE_TASKS)
+	case KORE_TYPE_TASK:
+		kore_task_handle(op->udata, 0);
+		break;
+#endif
+	default:
+		fatal("wrong type in event %d", type);
+	}
+
+	return (r);
+}
+
+static void
+uring_add(int fd, u_int8_t type, u_int32_t events, void *udata)
+{
+	struct uring_op		*op;
+	int			len;
+
+	if (fd >= uring_fds_len) {
+		len = MAX(fd + 1, uring_fds_len * 2);
+		uring_fds = kore_realloc(uring_fds, len * sizeof(*uring_fds));
+		memset(uring_fds + uring_fds_len, 0,
+		    (len - uring_fds_len) * sizeof(*uring_fds));
+		uring_fds_len = len;
+	}
+
+	/* Never leave a live request behind pointing at stale udata. */
+	if (uring_fds[fd] != NULL)
+		uring_remove(fd);
+
+	op = kore_malloc(sizeof(*op));
+	op->fd = fd;
+	op->refs = 0;
+	op->flags = 0;
+	op->type = type;
+	op->events = events;
+	op->udata = udata;
+
+	uring_fds[fd] = op;
+	uring_arm(op);
+}
+
+/*
+ * Stop delivering events for fd. The request holds a reference to the
+ * file, so this must happen before the descriptor gets closed or the
+ * socket would stay open until the request ends on its own.
+ */
+static void
+uring_remove(int fd)
+{
+	struct uring_op		*op;
+	struct io_uring_sqe	*sqe;
+
+	if (fd >= uring_fds_len || (op = uring_fds[fd]) == NULL)
+		return;
+
+	uring_fds[fd] = NULL;
+	op->flags |= URING_OP_DEAD;
+	op->refs++;
+
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (u_int64_t)(uintptr_t)op;
+	sqe->user_data = (u_int64_t)(uintptr_t)op | URING_CANCEL_TAG;
+}
+
+static void
+uring_arm(struct uring_op *op)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = uring_sqe();
+	sqe->fd = op->fd;
+	sqe->user_data = (u_int64_t)(uintptr_t)op;
+
+	switch (op->type) {
+	case URING_OP_ACCEPT:
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK;
+		break;
+	case URING_OP_POLL:
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->len = IORING_POLL_ADD_MULTI;
+		sqe->poll32_events = op->events;
+		break;
+	default:
+		fatal("uring_arm: wrong op type %d", op->type);
+	}
+
+	op->refs++;
+}
+
+static void
+uring_release(struct uring_op *op)
+{
+	if (--op->refs == 0)
+		kore_free(op);
+}
+
+static struct io_uring_sqe *
+uring_sqe(void)
+{
+	struct io_uring_sqe	*sqe;
+
+	if (sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) ==
+	    sq_entries) {
+		if (uring_enter(0, 0) == -1 && errno != EINTR &&
+		    errno != EBUSY && errno != EAGAIN)
+			fatal("io_uring_enter(): %s", errno_s);
+		if (sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) ==
+		    sq_entries)
+			fatal("io_uring: submission queue stuck");
+	}
+
+	sqe = &sqes[sq_local & sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_local++;
+
+	return (sqe);
+}
+
+/*
+ * Submit everything queued since the last call and, if asked to, wait
+ * up to timer milliseconds for at least one completion.
+ */
+static int
+uring_enter(u_int32_t wait, u_int64_t timer)
+{
+	struct io_uring_getevents_arg	arg;
+	struct __kernel_timespec	ts;
+	u_int32_t			submit, flags;
+
+	__atomic_store_n(sq_tail, sq_local, __ATOMIC_RELEASE);
+	submit = sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+	flags = IORING_ENTER_EXT_ARG;
+	memset(&arg, 0, sizeof(arg));
+
+	if (wait) {
+		flags |= IORING_ENTER_GETEVENTS;
+		ts.tv_sec = timer / 1000;
+		ts.tv_nsec = (timer % 1000) * 1000000;
+		arg.ts = (u_int64_t)(uintptr_t)&ts;
+	} else if (submit == 0) {
+		return (0);
+	}
+
+	return (syscall(__NR_io_uring_enter, ufd, submit, wait ? 1 : 0,
+	    flags, &arg, sizeof(arg)));
+}
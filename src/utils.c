@@ -26,6 +26,20 @@
 
 #include "kore.h"
 
+/*
+ * The cached clock only has to be as precise as the event loop, use the
+ * cheapest monotonic clock the platform offers for it.
+ */
+#if defined(CLOCK_MONOTONIC_COARSE)
+#define KORE_CLOCK_CACHED	CLOCK_MONOTONIC_COARSE
+#elif defined(CLOCK_MONOTONIC_FAST)
+#define KORE_CLOCK_CACHED	CLOCK_MONOTONIC_FAST
+#else
+#define KORE_CLOCK_CACHED	CLOCK_MONOTONIC
+#endif
+
+static u_int64_t	time_cached = 0;
+
 static struct {
 	char		*name;
 	int		value;
@@ -87,8 +101,12 @@ kore_log(int prio, const char *fmt, ...)
 	if (worker != NULL) {
 		(void)snprintf(tmp, sizeof(tmp), "wrk %d", worker->id);
 #if !defined(KORE_NO_TLS)
-		if (worker->id == KORE_WORKER_KEYMGR)
+		if (worker->id == KORE_WORKER_KEYMGR) {
 			(void)kore_strlcpy(tmp, "keymgr", sizeof(tmp));
+		} else if (kore_worker_is_keymgr(worker->id)) {
+			(void)snprintf(tmp, sizeof(tmp),
+			    "keymgr %d", worker->id);
+		}
 #endif
 		if (foreground)
 			printf("[%s]: %s\n", tmp, buf);
@@ -376,6 +394,45 @@ kore_time_ms(void)
 	return (tv.tv_sec * 1000 + (tv.tv_usec / 1000));
 }
 
+/*
+ * Refresh the cached monotonic clock, done every time the event loop
+ * returns. Everything on the hot path reads kore_time_mono_ms() instead
+ * of asking the kernel over and over again.
+ */
+u_int64_t
+kore_time_update(void)
+{
+	struct timespec		ts;
+
+	if (clock_gettime(KORE_CLOCK_CACHED, &ts) == -1)
+		return (time_cached);
+
+	time_cached = (u_int64_t)ts.tv_sec * 1000 + (ts.tv_nsec / 1000000);
+
+	return (time_cached);
+}
+
+u_int64_t
+kore_time_mono_ms(void)
+{
+	if (time_cached == 0)
+		return (kore_time_update());
+
+	return (time_cached);
+}
+
+/* Precise monotonic time, for measuring how long something took. */
+u_int64_t
+kore_time_mono_us(void)
+{
+	struct timespec		ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return (0);
+
+	return ((u_int64_t)ts.tv_sec * 1000000 + (ts.tv_nsec / 1000));
+}
+
 int
 kore_base64_encode(const void *data, size_t len, char **out)
 {
@@ -508,19 +565,21 @@ kore_base64_decode(char *in, u_int8_t **out, size_t *olen)
 }
 
 void *
-kore_mem_find(void *src, size_t slen, void *needle, size_t len)
+kore_mem_find(void *src, size_t slen, const void *needle, size_t len)
 {
-	size_t		pos;
+	u_int8_t	*p, *end;
 
-	for (pos = 0; pos < slen; pos++) {
-		if ( *((u_int8_t *)src + pos) != *(u_int8_t *)needle)
-			continue;
+	if (len == 0 || len > slen)
+		return (NULL);
 
-		if ((slen - pos) < len)
-			return (NULL);
+	p = src;
+	end = p + (slen - len) + 1;
 
-		if (!memcmp((u_int8_t *)src + pos, needle, len))
-			return ((u_int8_t *)src + pos);
+	/* memchr() is vectorized by the libc, let it find candidates. */
+	while ((p = memchr(p, *(const u_int8_t *)needle, end - p)) != NULL) {
+		if (!memcmp(p, needle, len))
+			return (p);
+		p++;
 	}
 
 	return (NULL);
@@ -586,7 +645,7 @@ fatal(const char *fmt, ...)
 		kore_log(LOG_ERR, "%s", buf);
 
 #if !defined(KORE_NO_TLS)
-	if (worker != NULL && worker->id == KORE_WORKER_KEYMGR)
+	if (worker != NULL && kore_worker_is_keymgr(worker->id))
 		kore_keymgr_cleanup();
 #endif
 
@@ -57,12 +57,13 @@ kore_websocket_handshake(struct http_request *req, const char *onconnect,
 	char			*key, *base64, *version;
 	u_int8_t		digest[SHA_DIGEST_LENGTH];
 
-	if (!http_request_header(req, "sec-websocket-key", &key)) {
+	if (!http_request_header_id(req, HTTP_HDR_SEC_WEBSOCKET_KEY, &key)) {
 		http_response(req, HTTP_STATUS_BAD_REQUEST, NULL, 0);
 		return;
 	}
 
-	if (!http_request_header(req, "sec-websocket-version", &version)) {
+	if (!http_request_header_id(req,
+	    HTTP_HDR_SEC_WEBSOCKET_VERSION, &version)) {
 		http_response_header(req, "sec-websocket-version", "13");
 		http_response(req, HTTP_STATUS_BAD_REQUEST, NULL, 0);
 		return;
@@ -103,8 +104,8 @@ kore_websocket_handshake(struct http_request *req, const char *onconnect,
 	req->owner->disconnect = websocket_disconnect;
 	req->owner->rnb->flags &= ~NETBUF_CALL_CB_ALWAYS;
 
-	req->owner->idle_timer.start = kore_time_ms();
 	req->owner->idle_timer.length = kore_websocket_timeout;
+	kore_connection_start_idletimer(req->owner);
 
 	if (onconnect != NULL) {
 		req->owner->ws_connect = kore_runtime_getcall(onconnect);
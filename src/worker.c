@@ -59,6 +59,7 @@
 #endif
 
 #define WORKER_LOCK_TIMEOUT	500
+#define WORKER_LOAD_REPORT	(60 * 1000)
 
 #define WORKER(id)						\
 	(struct kore_worker *)((u_int8_t *)kore_workers +	\
@@ -74,6 +75,9 @@ static void	worker_unlock(void);
 
 static inline int	kore_worker_acceptlock_obtain(void);
 static inline void	kore_worker_acceptlock_release(void);
+static inline u_int16_t	worker_http_first(void);
+static void		worker_load_publish(u_int64_t);
+static int		worker_load_acceptable(void);
 
 #if !defined(KORE_NO_TLS)
 static void		worker_entropy_recv(struct kore_msg *, const void *);
@@ -104,13 +108,34 @@ kore_worker_init(void)
 		worker_count = 1;
 
 #if !defined(KORE_NO_TLS)
-	/* account for the key manager. */
-	worker_count += 1;
+	/*
+	 * Account for the key managers. The first one always sits at
+	 * KORE_WORKER_KEYMGR, any additional ones come after the workers.
+	 */
+	if (keymgr_workers == 0)
+		keymgr_workers = 1;
+	if (worker_count + keymgr_workers > UCHAR_MAX)
+		fatal("too many workers and keymgr workers");
+	worker_count += keymgr_workers;
 #endif
 
+	if (kore_socket_reuseport) {
+#if !defined(KORE_NO_TLS)
+		kore_listener_reuseport(worker_count - keymgr_workers,
+		    worker_http_first());
+#else
+		kore_listener_reuseport(worker_count, worker_http_first());
+#endif
+	}
+
 	len = sizeof(*accept_lock) +
 	    (sizeof(struct kore_worker) * worker_count);
 
+#if !defined(KORE_NO_TLS)
+	/* The shared TLS session cache lives right after the workers. */
+	len += kore_domain_tls_cache_len();
+#endif
+
 	shm_accept_key = shmget(IPC_PRIVATE, len, IPC_CREAT | IPC_EXCL | 0700);
 	if (shm_accept_key == -1)
 		fatal("kore_worker_init(): shmget() %s", errno_s);
@@ -124,6 +149,11 @@ kore_worker_init(void)
 	    sizeof(*accept_lock));
 	memset(kore_workers, 0, sizeof(struct kore_worker) * worker_count);
 
+#if !defined(KORE_NO_TLS)
+	kore_domain_tls_cache_init((u_int8_t *)kore_workers +
+	    (sizeof(struct kore_worker) * worker_count));
+#endif
+
 	kore_debug("kore_worker_init(): system has %d cpu's", cpu_count);
 	kore_debug("kore_worker_init(): starting %d workers", worker_count);
 
@@ -149,6 +179,9 @@ kore_worker_spawn(u_int16_t id, u_int16_t cpu)
 	kw->cpu = cpu;
 	kw->has_lock = 0;
 	kw->active_hdlr = NULL;
+	kw->load_connections = 0;
+	kw->load_requests = 0;
+	kw->load_latency = 0;
 
 	if (socketpair(AF_UNIX, SOCK_STREAM, 0, kw->pipe) == -1)
 		fatal("socketpair(): %s", errno_s);
@@ -177,6 +210,33 @@ kore_worker_data(u_int8_t id)
 	return (WORKER(id));
 }
 
+int
+kore_worker_is_keymgr(u_int16_t id)
+{
+#if !defined(KORE_NO_TLS)
+	if (id == KORE_WORKER_KEYMGR)
+		return (1);
+
+	if (id >= worker_count - (keymgr_workers - 1) && id < worker_count)
+		return (1);
+#endif
+
+	return (0);
+}
+
+u_int16_t
+kore_worker_keymgr_id(u_int8_t idx)
+{
+#if !defined(KORE_NO_TLS)
+	if (idx == 0 || idx >= keymgr_workers)
+		return (KORE_WORKER_KEYMGR);
+
+	return (worker_count - keymgr_workers + idx);
+#else
+	return (KORE_WORKER_KEYMGR);
+#endif
+}
+
 void
 kore_worker_shutdown(void)
 {
@@ -280,7 +340,7 @@ kore_worker_entry(struct kore_worker *kw)
 	struct kore_runtime_call	*rcall;
 	char				buf[16];
 	int				quit, had_lock, r;
-	u_int64_t			now, next_lock, netwait;
+	u_int64_t			now, next_lock, netwait, start;
 #if !defined(KORE_NO_TLS)
 	u_int64_t			last_seed;
 #endif
@@ -289,7 +349,7 @@ kore_worker_entry(struct kore_worker *kw)
 
 	(void)snprintf(buf, sizeof(buf), "kore [wrk %d]", kw->id);
 #if !defined(KORE_NO_TLS)
-	if (kw->id == KORE_WORKER_KEYMGR)
+	if (kore_worker_is_keymgr(kw->id))
 		(void)snprintf(buf, sizeof(buf), "kore [keymgr]");
 #endif
 	kore_platform_proctitle(buf);
@@ -311,12 +371,15 @@ kore_worker_entry(struct kore_worker *kw)
 		signal(SIGINT, SIG_IGN);
 
 #if !defined(KORE_NO_TLS)
-	if (kw->id == KORE_WORKER_KEYMGR) {
+	if (kore_worker_is_keymgr(kw->id)) {
 		kore_keymgr_run();
 		exit(0);
 	}
 #endif
 
+	if (kore_socket_reuseport)
+		kore_listener_select(kw->id - worker_http_first());
+
 	kore_worker_privdrop();
 
 	net_init();
@@ -348,9 +411,10 @@ kore_worker_entry(struct kore_worker *kw)
 #if !defined(KORE_NO_TLS)
 	last_seed = 0;
 	kore_msg_register(KORE_MSG_ENTROPY_RESP, worker_entropy_recv);
+	kore_msg_send(KORE_WORKER_KEYMGR, KORE_MSG_TICKET_REQ, NULL, 0);
 #endif
 
-	if (nlisteners == 0)
+	if (nlisteners == 0 || kore_socket_reuseport)
 		worker_no_lock = 1;
 
 	kore_log(LOG_NOTICE, "worker %d started (cpu#%d)", kw->id, kw->cpu);
@@ -381,11 +445,17 @@ kore_worker_entry(struct kore_worker *kw)
 			sig_recv = 0;
 		}
 
-		now = kore_time_ms();
+		now = kore_time_update();
 		netwait = kore_timer_run(now);
 		if (netwait > 100)
 			netwait = 100;
 
+#if !defined(KORE_NO_HTTP)
+		/* Don't sleep while requests are still waiting to run. */
+		if (http_process_ready())
+			netwait = 0;
+#endif
+
 #if !defined(KORE_NO_TLS)
 		if ((now - last_seed) > KORE_RESEED_TIME) {
 			kore_msg_send(KORE_WORKER_KEYMGR,
@@ -411,6 +481,7 @@ kore_worker_entry(struct kore_worker *kw)
 		}
 
 		r = kore_platform_event_wait(netwait);
+		start = kore_time_mono_us();
 		if (worker->has_lock && r > 0) {
 			kore_worker_acceptlock_release();
 			next_lock = now + WORKER_LOCK_TIMEOUT;
@@ -421,8 +492,13 @@ kore_worker_entry(struct kore_worker *kw)
 #endif
 
 		kore_connection_check_timeout();
+#if !defined(KORE_NO_TLS)
+		kore_domain_keymgr_timeout();
+#endif
 		kore_connection_prune(KORE_CONNECTION_PRUNE_DISCONNECT);
 
+		worker_load_publish(kore_time_mono_us() - start);
+
 		if (quit)
 			break;
 	}
@@ -493,7 +569,7 @@ kore_worker_wait(int final)
 			    "none");
 
 #if !defined(KORE_NO_TLS)
-			if (id == KORE_WORKER_KEYMGR) {
+			if (kore_worker_is_keymgr(id)) {
 				kore_log(LOG_CRIT, "keymgr gone, stopping");
 				kw->pid = 0;
 				if (raise(SIGTERM) != 0) {
@@ -548,6 +624,13 @@ kore_worker_acceptlock_obtain(void)
 {
 	int		r;
 
+	/* Each worker owns its listener, only back off when full. */
+	if (kore_socket_reuseport) {
+		worker->has_lock =
+		    worker_active_connections < worker_max_connections;
+		return (worker->has_lock);
+	}
+
 	if (worker->has_lock == 1)
 		return (1);
 
@@ -559,6 +642,9 @@ kore_worker_acceptlock_obtain(void)
 	if (worker_active_connections >= worker_max_connections)
 		return (0);
 
+	if (!worker_load_acceptable())
+		return (0);
+
 	r = 0;
 	if (worker_trylock()) {
 		r = 1;
@@ -568,6 +654,97 @@ kore_worker_acceptlock_obtain(void)
 	return (r);
 }
 
+/*
+ * Workers that accept connections are the ones between the keymgr
+ * at KORE_WORKER_KEYMGR and any additional keymgrs at the end.
+ */
+static inline u_int16_t
+worker_http_first(void)
+{
+#if !defined(KORE_NO_TLS)
+	return (KORE_WORKER_KEYMGR + 1);
+#else
+	return (0);
+#endif
+}
+
+void
+kore_worker_load_report(void)
+{
+	u_int16_t		id;
+	struct kore_worker	*kw;
+	static u_int64_t	last = 0;
+	u_int64_t		now;
+	u_int32_t		n, total, min, max, latency;
+
+	now = kore_time_mono_ms();
+	if ((now - last) < WORKER_LOAD_REPORT)
+		return;
+
+	last = now;
+	n = total = max = latency = 0;
+	min = UINT_MAX;
+
+	for (id = 0; id < worker_count; id++) {
+		kw = WORKER(id);
+		if (kw->pid == 0 || kore_worker_is_keymgr(id))
+			continue;
+
+		n++;
+		total += kw->load_connections;
+		if (kw->load_connections < min)
+			min = kw->load_connections;
+		if (kw->load_connections > max)
+			max = kw->load_connections;
+		if (kw->load_latency > latency)
+			latency = kw->load_latency;
+	}
+
+	if (n == 0 || total == 0)
+		return;
+
+	kore_log(LOG_INFO,
+	    "worker load: %u connections, min %u max %u avg %u, latency %uus",
+	    total, min, max, total / n, latency);
+}
+
+static void
+worker_load_publish(u_int64_t latency)
+{
+	worker->load_connections = worker_active_connections;
+#if !defined(KORE_NO_HTTP)
+	worker->load_requests = http_request_count;
+#endif
+	worker->load_latency = ((worker->load_latency * 7) + latency) / 8;
+}
+
+/*
+ * Only contend for the accept lock when this worker is carrying no more
+ * than the average load of its peers, so busy workers (long lived
+ * websockets, slow handlers) stop being handed new connections.
+ */
+static int
+worker_load_acceptable(void)
+{
+	u_int16_t		id;
+	struct kore_worker	*kw;
+	u_int64_t		load, total, n;
+
+	load = worker->load_connections + worker->load_requests;
+	total = n = 0;
+
+	for (id = 0; id < worker_count; id++) {
+		kw = WORKER(id);
+		if (kw->pid == 0 || kore_worker_is_keymgr(id))
+			continue;
+
+		n++;
+		total += kw->load_connections + kw->load_requests;
+	}
+
+	return ((load * n) <= total);
+}
+
 static int
 worker_trylock(void)
 {